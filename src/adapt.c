@@ -0,0 +1,128 @@
+// PMTUD
+//
+// Copyright (c) 2015 CloudFlare, Inc.
+//
+// Adaptive interface rate. Once per interval the controller looks at
+// signs of the host or the NIC not keeping up:
+//
+//  - packets dropped by the capture, pcap ring or NFLOG queue,
+//  - send() failing with ENOBUFS,
+//  - tx_dropped of the interface in /sys/class/net, if available,
+//
+// and adjusts the rate using AIMD: any new drop halves the rate, an
+// interval without drops increases it by a fixed step. The rate always
+// stays within the configured floor and ceiling.
+
+#include <getopt.h>
+#include <limits.h>
+#include <pcap.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "pmtud.h"
+
+#define ADAPT_DECREASE 0.5
+/* Additive increase, from floor to ceiling in this many intervals */
+#define ADAPT_STEPS 20
+
+struct adapt
+{
+	double floor;
+	double ceiling;
+	double rate;
+
+	/* Totals at the previous sample */
+	uint64_t drops;
+	uint64_t enobufs;
+	uint64_t tx_dropped;
+
+	char tx_dropped_path[PATH_MAX];
+};
+
+static int read_counter(const char *path, uint64_t *value)
+{
+	FILE *f = fopen(path, "r");
+	if (f == NULL) {
+		return -1;
+	}
+	unsigned long long v;
+	int r = fscanf(f, "%llu", &v);
+	fclose(f);
+	if (r != 1) {
+		return -1;
+	}
+	*value = v;
+	return 0;
+}
+
+struct adapt *adapt_alloc(const char *iface, double floor, double ceiling,
+			  double rate)
+{
+	struct adapt *a = calloc(1, sizeof(struct adapt));
+	a->floor = floor;
+	a->ceiling = ceiling;
+	a->rate = rate < floor ? floor : (rate > ceiling ? ceiling : rate);
+
+	snprintf(a->tx_dropped_path, sizeof(a->tx_dropped_path),
+		 "/sys/class/net/%s/statistics/tx_dropped", iface);
+	if (read_counter(a->tx_dropped_path, &a->tx_dropped) < 0) {
+		a->tx_dropped_path[0] = '\0';
+	}
+	return a;
+}
+
+void adapt_free(struct adapt *a) { free(a); }
+
+double adapt_rate(struct adapt *a) { return a->rate; }
+
+int adapt_sample(struct adapt *a, uint64_t drops, uint64_t enobufs)
+{
+	uint64_t tx_dropped = a->tx_dropped;
+	if (a->tx_dropped_path[0]) {
+		read_counter(a->tx_dropped_path, &tx_dropped);
+	}
+
+	int congested = drops != a->drops || enobufs != a->enobufs ||
+			tx_dropped != a->tx_dropped;
+	a->drops = drops;
+	a->enobufs = enobufs;
+	a->tx_dropped = tx_dropped;
+
+	double rate = a->rate;
+	if (congested) {
+		rate *= ADAPT_DECREASE;
+	} else {
+		rate += (a->ceiling - a->floor) / ADAPT_STEPS;
+	}
+	rate = rate < a->floor ? a->floor : rate;
+	rate = rate > a->ceiling ? a->ceiling : rate;
+
+	if (rate == a->rate) {
+		return 0;
+	}
+	a->rate = rate;
+	return 1;
+}
+
+int adapt_export(struct adapt *a, const char *path)
+{
+	char tmp[PATH_MAX];
+	snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+
+	FILE *f = fopen(tmp, "w");
+	if (f == NULL) {
+		return -1;
+	}
+	fprintf(f,
+		"rate=%.2f floor=%.2f ceiling=%.2f drops=%lu enobufs=%lu "
+		"tx_dropped=%lu\n",
+		a->rate, a->floor, a->ceiling, a->drops, a->enobufs,
+		a->tx_dropped);
+	if (fclose(f) != 0) {
+		return -1;
+	}
+	/* Readers never see a partial file */
+	return rename(tmp, path);
+}
@@ -0,0 +1,368 @@
+// PMTUD
+//
+// Copyright (c) 2015 CloudFlare, Inc.
+//
+// Bundling of forwarded ICMP messages. Instead of broadcasting every
+// accepted PTB in its own frame, PTBs collected over a short window
+// are packed into a single jumbo frame with a dedicated EtherType:
+//
+//    +-------------------+----------------------------+
+//    | ethernet header   | dst ff:ff:ff:ff:ff:ff      |
+//    |                   | type BUNDLE_ETHERTYPE      |
+//    +-------------------+----------------------------+
+//    | bundle header     | version  (u8)              |
+//    |                   | count    (u8)              |
+//    |                   | length   (u16, net order)  |
+//    +-------------------+----------------------------+
+//    | record, repeated  | type     (u8, 4 or 6)      |
+//    |                   | length   (u16, net order)  |
+//    |                   | value    (L3 packet)       |
+//    +-------------------+----------------------------+
+//
+// Records reference the captured frames in the packet pool and the
+// bundle is sent with a single sendmsg() gathering all of them, so
+// PTBs are not copied again while waiting for the window to close.
+//
+// PTBs captured on an 802.1Q VLAN are bundled with others of the same
+// VLAN only, and the bundle is sent with their tag. The bundle header
+// then follows the tag, as in any tagged frame.
+//
+// A pmtud in receiver mode unpacks the bundle and injects every
+// record as a separate ethernet frame on a local interface.
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <getopt.h>
+#include <pcap.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <time.h>
+
+#include "pktpool.h"
+#include "pmtud.h"
+
+#define BUNDLE_VERSION 1
+#define BUNDLE_HDR_LEN 4
+#define BUNDLE_REC_LEN 3
+#define BUNDLE_MAX_COUNT 255
+/* VLANs with a bundle open at once */
+#define BUNDLE_GROUPS 8
+
+struct bundle_rec
+{
+	struct pktbuf *buf;
+	unsigned l3_offset;
+	uint8_t tlv[BUNDLE_REC_LEN];
+};
+
+/* Records of one VLAN, sent in a frame with the same 802.1Q tag as the
+ * frames they were captured in. */
+struct bundle_group
+{
+	/* Tag control information, -1 for untagged frames */
+	int tci;
+	/* Monotonic timestamp of the first record, 0 when empty. */
+	uint64_t first_ns;
+	unsigned count;
+	/* Bundle header and records, without the ethernet header */
+	unsigned len;
+
+	uint8_t hdr[18 + BUNDLE_HDR_LEN];
+	unsigned hdr_len;
+	struct bundle_rec recs[BUNDLE_MAX_COUNT];
+};
+
+struct bundle
+{
+	int sd;
+	struct pktpool *pool;
+	unsigned mtu;
+	uint64_t window_ns;
+
+	uint64_t sent_bundles;
+	uint64_t sent_records;
+	uint64_t enobufs;
+
+	struct bundle_group groups[BUNDLE_GROUPS];
+	struct iovec iov[1 + 2 * BUNDLE_MAX_COUNT];
+};
+
+static uint64_t monotonic_now()
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return TIMESPEC_NSEC(&now);
+}
+
+struct bundle *bundle_alloc(int sd, struct pktpool *pool, unsigned mtu,
+			    uint64_t window_ns)
+{
+	struct bundle *b = calloc(1, sizeof(struct bundle));
+
+	b->sd = sd;
+	b->pool = pool;
+	b->mtu = mtu;
+	b->window_ns = window_ns;
+	return b;
+}
+
+void bundle_free(struct bundle *b)
+{
+	unsigned g, i;
+	for (g = 0; g < BUNDLE_GROUPS; g++) {
+		for (i = 0; i < b->groups[g].count; i++) {
+			pktbuf_put(b->pool, b->groups[g].recs[i].buf);
+		}
+	}
+	free(b);
+}
+
+static void group_flush(struct bundle *b, struct bundle_group *grp)
+{
+	unsigned payload_len = grp->len - BUNDLE_HDR_LEN;
+	uint8_t *bundle_hdr = &grp->hdr[grp->hdr_len - BUNDLE_HDR_LEN];
+	bundle_hdr[1] = grp->count;
+	bundle_hdr[2] = payload_len >> 8;
+	bundle_hdr[3] = payload_len & 0xff;
+
+	struct iovec *iov = b->iov;
+	iov->iov_base = grp->hdr;
+	iov->iov_len = grp->hdr_len;
+	iov++;
+
+	unsigned i;
+	for (i = 0; i < grp->count; i++) {
+		struct bundle_rec *rec = &grp->recs[i];
+		iov->iov_base = rec->tlv;
+		iov->iov_len = BUNDLE_REC_LEN;
+		iov++;
+		iov->iov_base = &rec->buf->data[rec->l3_offset];
+		iov->iov_len = rec->buf->len - rec->l3_offset;
+		iov++;
+	}
+
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = b->iov;
+	msg.msg_iovlen = iov - b->iov;
+
+	int r = sendmsg(b->sd, &msg, 0);
+	/* ENOBUFS happens during IRQ storms okay to ignore */
+	if (r < 0 && errno != ENOBUFS) {
+		PFATAL("sendmsg()");
+	}
+	if (r < 0) {
+		b->enobufs += 1;
+	}
+
+	for (i = 0; i < grp->count; i++) {
+		pktbuf_put(b->pool, grp->recs[i].buf);
+		grp->recs[i].buf = NULL;
+	}
+
+	b->sent_bundles += 1;
+	b->sent_records += grp->count;
+
+	grp->first_ns = 0;
+	grp->count = 0;
+}
+
+int bundle_flush(struct bundle *b)
+{
+	int sent = 0;
+	unsigned g;
+	for (g = 0; g < BUNDLE_GROUPS; g++) {
+		if (b->groups[g].count) {
+			group_flush(b, &b->groups[g]);
+			sent += 1;
+		}
+	}
+	return sent;
+}
+
+/* Open bundle of the VLAN, or an empty one. If all are taken the
+ * oldest is sent to make room. */
+static struct bundle_group *group_of(struct bundle *b, int tci)
+{
+	struct bundle_group *empty = NULL, *oldest = NULL;
+	unsigned g;
+	for (g = 0; g < BUNDLE_GROUPS; g++) {
+		struct bundle_group *grp = &b->groups[g];
+		if (grp->count == 0) {
+			empty = empty ? empty : grp;
+		} else if (grp->tci == tci) {
+			return grp;
+		} else if (oldest == NULL || grp->first_ns < oldest->first_ns) {
+			oldest = grp;
+		}
+	}
+	if (empty) {
+		return empty;
+	}
+	group_flush(b, oldest);
+	return oldest;
+}
+
+int bundle_add(struct bundle *b, struct pktbuf *buf, unsigned l3_offset)
+{
+	const uint8_t *frame = buf->data;
+	unsigned l3_len = buf->len - l3_offset;
+	if (BUNDLE_HDR_LEN + BUNDLE_REC_LEN + l3_len > b->mtu) {
+		/* Will never fit, caller must send it on its own. */
+		return -1;
+	}
+
+	int tci = l3_offset == 18 ? ((uint16_t)frame[14] << 8) | frame[15]
+				  : -1;
+	struct bundle_group *grp = group_of(b, tci);
+	if (grp->len + BUNDLE_REC_LEN + l3_len > b->mtu ||
+	    grp->count == BUNDLE_MAX_COUNT) {
+		group_flush(b, grp);
+	}
+
+	if (grp->count == 0) {
+		uint8_t *hdr = grp->hdr;
+		memset(&hdr[0], 0xff, 6);
+		/* Source MAC is the address the PTB was sent to, same
+		 * as for unbundled broadcasts. */
+		memcpy(&hdr[6], &frame[6], 6);
+		grp->hdr_len = 12;
+		if (tci >= 0) {
+			hdr[grp->hdr_len++] = 0x81;
+			hdr[grp->hdr_len++] = 0x00;
+			hdr[grp->hdr_len++] = tci >> 8;
+			hdr[grp->hdr_len++] = tci & 0xff;
+		}
+		hdr[grp->hdr_len++] = BUNDLE_ETHERTYPE >> 8;
+		hdr[grp->hdr_len++] = BUNDLE_ETHERTYPE & 0xff;
+		hdr[grp->hdr_len] = BUNDLE_VERSION;
+		grp->hdr_len += BUNDLE_HDR_LEN;
+
+		grp->tci = tci;
+		grp->len = BUNDLE_HDR_LEN;
+		grp->first_ns = monotonic_now();
+	}
+
+	struct bundle_rec *rec = &grp->recs[grp->count];
+	pktbuf_ref(buf);
+	rec->buf = buf;
+	rec->l3_offset = l3_offset;
+	rec->tlv[0] = (frame[l3_offset] & 0xF0) == 0x60 ? 6 : 4;
+	rec->tlv[1] = l3_len >> 8;
+	rec->tlv[2] = l3_len & 0xff;
+
+	grp->len += BUNDLE_REC_LEN + l3_len;
+	grp->count += 1;
+	return 0;
+}
+
+int bundle_poll(struct bundle *b, uint64_t *timeout_ns)
+{
+	uint64_t now = monotonic_now();
+	int sent = 0;
+	unsigned g;
+	for (g = 0; g < BUNDLE_GROUPS; g++) {
+		struct bundle_group *grp = &b->groups[g];
+		if (grp->count == 0) {
+			continue;
+		}
+
+		uint64_t deadline = grp->first_ns + b->window_ns;
+		if (now >= deadline) {
+			group_flush(b, grp);
+			sent += 1;
+		} else if (deadline - now < *timeout_ns) {
+			*timeout_ns = deadline - now;
+		}
+	}
+	return sent;
+}
+
+void bundle_stats(struct bundle *b, uint64_t *bundles, uint64_t *records,
+		  uint64_t *enobufs)
+{
+	*bundles = b->sent_bundles;
+	*records = b->sent_records;
+	*enobufs = b->enobufs;
+}
+
+int bundle_unpack(const uint8_t *p, unsigned data_len,
+		  int (*record_cb)(int type, const uint8_t *l3,
+				   unsigned l3_len, void *),
+		  void *userdata)
+{
+	unsigned offset = 14;
+	if (data_len < offset + BUNDLE_HDR_LEN) {
+		return -1;
+	}
+
+	uint16_t eth_type = (((uint16_t)p[12]) << 8) | (uint16_t)p[13];
+	if (eth_type == 0x8100 && data_len >= 18 + BUNDLE_HDR_LEN) {
+		eth_type = (((uint16_t)p[16]) << 8) | (uint16_t)p[17];
+		offset = 18;
+	}
+
+	if (eth_type != BUNDLE_ETHERTYPE || p[offset] != BUNDLE_VERSION) {
+		return -1;
+	}
+
+	unsigned count = p[offset + 1];
+	unsigned payload_len =
+		((uint16_t)p[offset + 2] << 8) | (uint16_t)p[offset + 3];
+	offset += BUNDLE_HDR_LEN;
+	if (data_len < offset + payload_len) {
+		return -1;
+	}
+
+	unsigned end = offset + payload_len;
+	unsigned i;
+	for (i = 0; i < count; i++) {
+		if (end < offset + BUNDLE_REC_LEN) {
+			return -1;
+		}
+		int type = p[offset];
+		unsigned l3_len = ((uint16_t)p[offset + 1] << 8) |
+				  (uint16_t)p[offset + 2];
+		offset += BUNDLE_REC_LEN;
+		if (end < offset + l3_len) {
+			return -1;
+		}
+		record_cb(type, &p[offset], l3_len, userdata);
+		offset += l3_len;
+	}
+	return count;
+}
+
+int bundle_inject(int sd, int type, const uint8_t *l3, unsigned l3_len)
+{
+	uint8_t eth_hdr[14];
+	memset(&eth_hdr[0], 0xff, 6);
+	memset(&eth_hdr[6], 0x00, 6);
+
+	if (type == 4 && l3_len >= 20 && (l3[0] & 0xF0) == 0x40) {
+		eth_hdr[12] = 0x08;
+		eth_hdr[13] = 0x00;
+	} else if (type == 6 && l3_len >= 40 && (l3[0] & 0xF0) == 0x60) {
+		eth_hdr[12] = 0x86;
+		eth_hdr[13] = 0xdd;
+	} else {
+		return -1;
+	}
+
+	struct iovec iov[2] = {{eth_hdr, sizeof(eth_hdr)},
+			       {(void *)l3, l3_len}};
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = iov;
+	msg.msg_iovlen = 2;
+
+	int r = sendmsg(sd, &msg, 0);
+	if (r < 0 && errno != ENOBUFS) {
+		PFATAL("sendmsg()");
+	}
+	return 0;
+}
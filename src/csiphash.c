@@ -146,3 +146,61 @@ uint64_t siphash24(const void *src, unsigned long src_sz, const char key[16])
 	DOUBLE_ROUND(v0, v1, v2, v3);
 	return (v0 ^ v1) ^ (v2 ^ v3);
 }
+
+/* siphash24() for the two key lengths pmtud hashes, IPv4 and IPv6
+ * addresses, with the length folded in and the loop unrolled. Same
+ * results as siphash24() on 4 and 16 bytes. */
+
+uint64_t siphash24_4(const void *src, const char key[16])
+{
+	uint64_t k0 = _le64toh(RD64p(&key[0]));
+	uint64_t k1 = _le64toh(RD64p(&key[8]));
+
+	uint64_t v0 = k0 ^ 0x736f6d6570736575ULL;
+	uint64_t v1 = k1 ^ 0x646f72616e646f6dULL;
+	uint64_t v2 = k0 ^ 0x6c7967656e657261ULL;
+	uint64_t v3 = k1 ^ 0x7465646279746573ULL;
+
+	uint64_t t = 0;
+	memcpy(&t, src, 4);
+	uint64_t b = (uint64_t)4 << 56 | _le64toh(t);
+
+	v3 ^= b;
+	DOUBLE_ROUND(v0, v1, v2, v3);
+	v0 ^= b;
+	v2 ^= 0xff;
+	DOUBLE_ROUND(v0, v1, v2, v3);
+	DOUBLE_ROUND(v0, v1, v2, v3);
+	return (v0 ^ v1) ^ (v2 ^ v3);
+}
+
+uint64_t siphash24_16(const void *src, const char key[16])
+{
+	uint64_t k0 = _le64toh(RD64p(&key[0]));
+	uint64_t k1 = _le64toh(RD64p(&key[8]));
+	const uint8_t *in = src;
+
+	uint64_t v0 = k0 ^ 0x736f6d6570736575ULL;
+	uint64_t v1 = k1 ^ 0x646f72616e646f6dULL;
+	uint64_t v2 = k0 ^ 0x6c7967656e657261ULL;
+	uint64_t v3 = k1 ^ 0x7465646279746573ULL;
+
+	uint64_t m0 = _le64toh(RD64p(&in[0]));
+	uint64_t m1 = _le64toh(RD64p(&in[8]));
+	uint64_t b = (uint64_t)16 << 56;
+
+	v3 ^= m0;
+	DOUBLE_ROUND(v0, v1, v2, v3);
+	v0 ^= m0;
+	v3 ^= m1;
+	DOUBLE_ROUND(v0, v1, v2, v3);
+	v0 ^= m1;
+
+	v3 ^= b;
+	DOUBLE_ROUND(v0, v1, v2, v3);
+	v0 ^= b;
+	v2 ^= 0xff;
+	DOUBLE_ROUND(v0, v1, v2, v3);
+	DOUBLE_ROUND(v0, v1, v2, v3);
+	return (v0 ^ v1) ^ (v2 ^ v3);
+}
@@ -0,0 +1,183 @@
+// PMTUD
+//
+// Copyright (c) 2015 CloudFlare, Inc.
+//
+// SipHash-2-4 of several keys at once, one key per 64 bit lane: four
+// with AVX2, eight with AVX-512. All the keys have the same length and
+// the same siphash key, as when a burst of packets is looked up in one
+// limiter, so every lane runs the same number of rounds. The results
+// are bit for bit those of siphash24().
+//
+// The instruction set is picked at runtime, the binary is still built
+// for the baseline. Without AVX2, for keys shorter than 8 bytes without
+// AVX-512, and for the keys left over after the last full group, keys
+// are hashed one at a time by siphash24().
+
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#define SIPHASH_SIMD
+#endif
+
+uint64_t siphash24(const void *src, unsigned long src_sz,
+		   const unsigned char key[16]);
+
+static int lanes;
+
+#ifdef SIPHASH_SIMD
+
+/* Word of the message, x86 is little endian. The last word holds the
+ * tail of the key and its length. */
+static inline uint64_t msg_word(const uint8_t *p, unsigned long len,
+				unsigned long word)
+{
+	uint64_t m = 0;
+	unsigned long off = word * 8;
+	if (off + 8 <= len) {
+		memcpy(&m, p + off, 8);
+		return m;
+	}
+	memcpy(&m, p + off, len - off);
+	return m | (uint64_t)len << 56;
+}
+
+#define ROTL_X4(x, b)                                                          \
+	_mm256_or_si256(_mm256_slli_epi64(x, b), _mm256_srli_epi64(x, 64 - (b)))
+#define ROTL32_X4(x) _mm256_shuffle_epi32(x, _MM_SHUFFLE(2, 3, 0, 1))
+
+/* Rotation by 16 is a byte shuffle */
+#define ROTL16_X4(x)                                                           \
+	_mm256_shuffle_epi8(x, _mm256_set_epi8(13, 12, 11, 10, 9, 8, 15, 14,   \
+					       5, 4, 3, 2, 1, 0, 7, 6, 13, 12, \
+					       11, 10, 9, 8, 15, 14, 5, 4, 3,  \
+					       2, 1, 0, 7, 6))
+
+#define HALF_ROUND_X4(a, b, c, d, s, rot_d)                                    \
+	a = _mm256_add_epi64(a, b);                                            \
+	c = _mm256_add_epi64(c, d);                                            \
+	b = _mm256_xor_si256(ROTL_X4(b, s), a);                                \
+	d = _mm256_xor_si256(rot_d, c);                                        \
+	a = ROTL32_X4(a);
+
+#define DOUBLE_ROUND_X4(v0, v1, v2, v3)                                        \
+	HALF_ROUND_X4(v0, v1, v2, v3, 13, ROTL16_X4(v3));                      \
+	HALF_ROUND_X4(v2, v1, v0, v3, 17, ROTL_X4(v3, 21));                    \
+	HALF_ROUND_X4(v0, v1, v2, v3, 13, ROTL16_X4(v3));                      \
+	HALF_ROUND_X4(v2, v1, v0, v3, 17, ROTL_X4(v3, 21));
+
+__attribute__((target("avx2"))) static void
+siphash24_x4(const uint8_t *const *src, unsigned long len, uint64_t k0,
+	     uint64_t k1, uint64_t *out)
+{
+	__m256i v0 = _mm256_set1_epi64x(k0 ^ 0x736f6d6570736575ULL);
+	__m256i v1 = _mm256_set1_epi64x(k1 ^ 0x646f72616e646f6dULL);
+	__m256i v2 = _mm256_set1_epi64x(k0 ^ 0x6c7967656e657261ULL);
+	__m256i v3 = _mm256_set1_epi64x(k1 ^ 0x7465646279746573ULL);
+
+	unsigned long w, words = len / 8 + 1;
+	for (w = 0; w < words; w++) {
+		__m256i m = _mm256_set_epi64x(
+			msg_word(src[3], len, w), msg_word(src[2], len, w),
+			msg_word(src[1], len, w), msg_word(src[0], len, w));
+		v3 = _mm256_xor_si256(v3, m);
+		DOUBLE_ROUND_X4(v0, v1, v2, v3);
+		v0 = _mm256_xor_si256(v0, m);
+	}
+
+	v2 = _mm256_xor_si256(v2, _mm256_set1_epi64x(0xff));
+	DOUBLE_ROUND_X4(v0, v1, v2, v3);
+	DOUBLE_ROUND_X4(v0, v1, v2, v3);
+	__m256i h = _mm256_xor_si256(_mm256_xor_si256(v0, v1),
+				     _mm256_xor_si256(v2, v3));
+	_mm256_storeu_si256((__m256i *)out, h);
+}
+
+#define HALF_ROUND_X8(a, b, c, d, s, t)                                        \
+	a = _mm512_add_epi64(a, b);                                            \
+	c = _mm512_add_epi64(c, d);                                            \
+	b = _mm512_xor_si512(_mm512_rol_epi64(b, s), a);                       \
+	d = _mm512_xor_si512(_mm512_rol_epi64(d, t), c);                       \
+	a = _mm512_rol_epi64(a, 32);
+
+#define DOUBLE_ROUND_X8(v0, v1, v2, v3)                                        \
+	HALF_ROUND_X8(v0, v1, v2, v3, 13, 16);                                 \
+	HALF_ROUND_X8(v2, v1, v0, v3, 17, 21);                                 \
+	HALF_ROUND_X8(v0, v1, v2, v3, 13, 16);                                 \
+	HALF_ROUND_X8(v2, v1, v0, v3, 17, 21);
+
+__attribute__((target("avx512f"))) static void
+siphash24_x8(const uint8_t *const *src, unsigned long len, uint64_t k0,
+	     uint64_t k1, uint64_t *out)
+{
+	__m512i v0 = _mm512_set1_epi64(k0 ^ 0x736f6d6570736575ULL);
+	__m512i v1 = _mm512_set1_epi64(k1 ^ 0x646f72616e646f6dULL);
+	__m512i v2 = _mm512_set1_epi64(k0 ^ 0x6c7967656e657261ULL);
+	__m512i v3 = _mm512_set1_epi64(k1 ^ 0x7465646279746573ULL);
+
+	unsigned long w, words = len / 8 + 1;
+	for (w = 0; w < words; w++) {
+		__m512i m = _mm512_set_epi64(
+			msg_word(src[7], len, w), msg_word(src[6], len, w),
+			msg_word(src[5], len, w), msg_word(src[4], len, w),
+			msg_word(src[3], len, w), msg_word(src[2], len, w),
+			msg_word(src[1], len, w), msg_word(src[0], len, w));
+		v3 = _mm512_xor_si512(v3, m);
+		DOUBLE_ROUND_X8(v0, v1, v2, v3);
+		v0 = _mm512_xor_si512(v0, m);
+	}
+
+	v2 = _mm512_xor_si512(v2, _mm512_set1_epi64(0xff));
+	DOUBLE_ROUND_X8(v0, v1, v2, v3);
+	DOUBLE_ROUND_X8(v0, v1, v2, v3);
+	__m512i h = _mm512_xor_si512(_mm512_xor_si512(v0, v1),
+				     _mm512_xor_si512(v2, v3));
+	_mm512_storeu_si512(out, h);
+}
+
+#endif
+
+int siphash24_batch_init(int max_lanes)
+{
+	lanes = 1;
+#ifdef SIPHASH_SIMD
+	__builtin_cpu_init();
+	if (max_lanes >= 8 && __builtin_cpu_supports("avx512f")) {
+		lanes = 8;
+	} else if (max_lanes >= 4 && __builtin_cpu_supports("avx2")) {
+		lanes = 4;
+	}
+#endif
+	return lanes;
+}
+
+void siphash24_batch(const uint8_t *const *src, unsigned long src_sz,
+		     const unsigned char key[16], uint64_t *out, unsigned n)
+{
+	if (lanes == 0) {
+		siphash24_batch_init(8);
+	}
+
+	unsigned i = 0;
+#ifdef SIPHASH_SIMD
+	uint64_t k0, k1;
+	memcpy(&k0, &key[0], 8);
+	memcpy(&k1, &key[8], 8);
+	if (lanes == 8) {
+		for (; i + 8 <= n; i += 8) {
+			siphash24_x8(&src[i], src_sz, k0, k1, &out[i]);
+		}
+	}
+	/* For keys shorter than a word, loading four lanes costs more than
+	 * the rounds it saves */
+	if (lanes >= 4 && src_sz >= 8) {
+		for (; i + 4 <= n; i += 4) {
+			siphash24_x4(&src[i], src_sz, k0, k1, &out[i]);
+		}
+	}
+#endif
+	for (; i < n; i++) {
+		out[i] = siphash24(src[i], src_sz, key);
+	}
+}
@@ -0,0 +1,263 @@
+// PMTUD
+//
+// Copyright (c) 2015 CloudFlare, Inc.
+//
+// Deficit round-robin scheduler in front of the interface limiter
+// (Shreedhar and Varghese, "Efficient Fair Queuing using Deficit
+// Round Robin"). Accepted PTBs are queued per flow, a flow being a
+// source or a source prefix hashed into a fixed number of queues, and
+// the active flows are served in turns whenever the interface limiter
+// has budget. Under contention every active flow gets an equal share,
+// however fast it sends.
+//
+// Every packet has a cost, and a flow gets a quantum of credit, its
+// deficit, per round. With a cost and quantum of one this is plain
+// round-robin over packets.
+//
+// Sending may be refused for the whole interface, which ends the run,
+// or for a single flow, as when its VLAN is out of budget. The flow
+// then loses its turn and the others are served. It keeps the quantum
+// it was granted but doesn't earn another until it has used it, so a
+// flow refused for a while gets no more than its share once its VLAN
+// has budget again.
+//
+// Queues are short and a PTB is useless once the sender has given up
+// on the connection, so packets waiting longer than max_delay are
+// dropped and reported to drop_cb.
+//
+// A packet is only queued after passing the source limits, which it is
+// charged to. drr_admit() tells beforehand whether there is room for
+// it, so a full queue costs the source nothing. A packet dropped for
+// waiting too long has used its source budget all the same, like a PTB
+// lost on the wire.
+
+#include <getopt.h>
+#include <pcap.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "pktpool.h"
+#include "pmtud.h"
+
+uint64_t siphash24(const void *src, unsigned long src_sz,
+		   const unsigned char key[16]);
+
+struct drr_pkt
+{
+	struct pktbuf *buf;
+	unsigned l3_offset;
+	unsigned cost;
+	uint64_t enqueued_ns;
+};
+
+struct drr_flow
+{
+	struct drr_pkt q[DRR_QLEN];
+	unsigned head;
+	unsigned len;
+
+	unsigned deficit;
+	/* Got its quantum for the current turn */
+	int granted;
+	int active;
+	struct drr_flow *next_active;
+};
+
+struct drr
+{
+	struct pktpool *pool;
+	unsigned flows_len;
+	unsigned quantum;
+	uint64_t max_delay_ns;
+	uint8_t key[16];
+
+	struct drr_flow *flows;
+	struct drr_flow *active_head;
+	struct drr_flow *active_tail;
+	unsigned active_len;
+
+	unsigned backlog;
+	struct drr_stats stats;
+};
+
+struct drr *drr_alloc(struct pktpool *pool, unsigned flows, unsigned quantum,
+		      uint64_t max_delay_ns)
+{
+	struct drr *d = calloc(1, sizeof(struct drr));
+	d->pool = pool;
+	d->flows_len = flows;
+	d->quantum = quantum;
+	d->max_delay_ns = max_delay_ns;
+	d->flows = calloc(flows, sizeof(struct drr_flow));
+
+	/* Random numbers for poor */
+	uint64_t a = (uint64_t)time(NULL) | getpid();
+	memcpy(&d->key[0], &a, 8);
+	a = (uintptr_t)d ^ getppid();
+	memcpy(&d->key[8], &a, 8);
+	return d;
+}
+
+static struct drr_pkt *flow_pop(struct drr *d, struct drr_flow *f)
+{
+	struct drr_pkt *pkt = &f->q[f->head];
+	f->head = (f->head + 1) % DRR_QLEN;
+	f->len -= 1;
+	d->backlog -= 1;
+	return pkt;
+}
+
+void drr_free(struct drr *d)
+{
+	unsigned i;
+	for (i = 0; i < d->flows_len; i++) {
+		struct drr_flow *f = &d->flows[i];
+		while (f->len) {
+			pktbuf_put(d->pool, flow_pop(d, f)->buf);
+		}
+	}
+	free(d->flows);
+	free(d);
+}
+
+static struct drr_flow *flow_of(struct drr *d, const uint8_t *flow_key,
+				int key_len)
+{
+	uint64_t hash = siphash24(flow_key, key_len, d->key);
+	return &d->flows[hash % d->flows_len];
+}
+
+int drr_admit(struct drr *d, const uint8_t *flow_key, int key_len)
+{
+	if (flow_of(d, flow_key, key_len)->len == DRR_QLEN) {
+		d->stats.dropped_full += 1;
+		return -1;
+	}
+	return 0;
+}
+
+int drr_enqueue(struct drr *d, const uint8_t *flow_key, int key_len,
+		struct pktbuf *buf, unsigned l3_offset, unsigned cost,
+		uint64_t now)
+{
+	struct drr_flow *f = flow_of(d, flow_key, key_len);
+	if (f->len == DRR_QLEN) {
+		d->stats.dropped_full += 1;
+		return -1;
+	}
+
+	struct drr_pkt *pkt = &f->q[(f->head + f->len) % DRR_QLEN];
+	pktbuf_ref(buf);
+	pkt->buf = buf;
+	pkt->l3_offset = l3_offset;
+	pkt->cost = cost;
+	pkt->enqueued_ns = now;
+	f->len += 1;
+	d->backlog += 1;
+	d->stats.enqueued += 1;
+
+	if (!f->active) {
+		f->active = 1;
+		f->granted = 0;
+		f->deficit = 0;
+		f->next_active = NULL;
+		d->active_len += 1;
+		if (d->active_tail) {
+			d->active_tail->next_active = f;
+		} else {
+			d->active_head = f;
+		}
+		d->active_tail = f;
+	}
+	return 0;
+}
+
+static void active_pop(struct drr *d)
+{
+	struct drr_flow *f = d->active_head;
+	d->active_head = f->next_active;
+	if (d->active_head == NULL) {
+		d->active_tail = NULL;
+	}
+	f->next_active = NULL;
+	d->active_len -= 1;
+}
+
+static void active_rotate(struct drr *d)
+{
+	struct drr_flow *f = d->active_head;
+	if (f == d->active_tail) {
+		return;
+	}
+	active_pop(d);
+	d->active_len += 1;
+	d->active_tail->next_active = f;
+	d->active_tail = f;
+}
+
+int drr_run(struct drr *d, uint64_t now,
+	    int (*send_cb)(struct pktbuf *buf, unsigned l3_offset, void *),
+	    void (*drop_cb)(struct pktbuf *buf, unsigned l3_offset, void *),
+	    void *userdata)
+{
+	int sent = 0;
+	/* Flows refused in a row, all of them means nothing can go */
+	unsigned skipped = 0;
+	while (d->active_head && skipped < d->active_len) {
+		struct drr_flow *f = d->active_head;
+
+		while (f->len &&
+		       now - f->q[f->head].enqueued_ns > d->max_delay_ns) {
+			struct drr_pkt *pkt = flow_pop(d, f);
+			if (drop_cb) {
+				drop_cb(pkt->buf, pkt->l3_offset, userdata);
+			}
+			pktbuf_put(d->pool, pkt->buf);
+			d->stats.dropped_stale += 1;
+		}
+
+		if (f->len == 0) {
+			f->active = 0;
+			active_pop(d);
+			continue;
+		}
+
+		if (!f->granted) {
+			f->deficit += d->quantum;
+			f->granted = 1;
+		}
+
+		struct drr_pkt *pkt = &f->q[f->head];
+		if (pkt->cost > f->deficit) {
+			/* Turn is over, the deficit is kept for the next */
+			f->granted = 0;
+			active_rotate(d);
+			continue;
+		}
+
+		/* Out of interface budget, resume from here next time */
+		int r = send_cb(pkt->buf, pkt->l3_offset, userdata);
+		if (r == 0) {
+			break;
+		}
+		if (r < 0) {
+			active_rotate(d);
+			skipped += 1;
+			continue;
+		}
+		skipped = 0;
+		f->deficit -= pkt->cost;
+		pktbuf_put(d->pool, flow_pop(d, f)->buf);
+		d->stats.sent += 1;
+		sent += 1;
+	}
+	return sent;
+}
+
+unsigned drr_backlog(struct drr *d) { return d->backlog; }
+
+void drr_stats(struct drr *d, struct drr_stats *stats) { *stats = d->stats; }
@@ -5,17 +5,95 @@
 // Rate limiting algorithm inspired by linux iptables hashlimit module.
 // http://lxr.free-electrons.com/source/net/netfilter/xt_hashlimit.c?v=3.17#L383
 // http://lxr.free-electrons.com/source/net/sched/sch_tbf.c?v=3.17#L26
+//
+// Three table layouts are supported:
+//
+//  - direct: bucket is picked by hash % size and no key is stored,
+//    unrelated keys that collide share a bucket,
+//
+//  - exact: open addressing with linear probing over a window of
+//    HL_PROBE slots, storing the 4 or 16 byte key. When the window is
+//    full an entry is evicted, preferring entries whose bucket is full
+//    again (forgetting them loses nothing), then using the CLOCK
+//    second chance policy. A new entry starts with full credit, so
+//    collisions and evictions may only cause a false pass, never a
+//    false ratelimit,
+//
+//  - sketch: count-min sketch of depth rows, each indexed by a
+//    hash with its own key. Every cell is a token bucket, that is a
+//    counter of spent credit decaying linearly with time. A key's
+//    credit is estimated as the maximum credit over its cells and
+//    charging uses conservative update, lowering a cell only down to
+//    the new estimate. Memory is bounded by width * depth cells, the
+//    price is that heavy keys sharing all of their cells may cause a
+//    false ratelimit of a light one. Increasing width lowers the
+//    overestimate, increasing depth lowers its probability.
+//
+// With a single cell the estimate and conservative update reduce to
+// the plain token bucket, so all the layouts share one code path.
+//
+// Keys are hashed with SipHash-2-4 unless a cheaper hash from hlhash.c
+// is picked with hashlimit_hash_function().
+//
+// GCRA tables are direct-mapped tables using the virtual scheduling
+// form of the same algorithm: each bucket stores only the theoretical
+// arrival time (tat) of the next packet, and a packet conforms if tat
+// is at most credit_max - touch_cost ahead of now. That takes 8 bytes
+// per bucket, or 4 in coarse tables which count time in units of
+// 2^shift nanoseconds, with the unit picked to keep touch_cost precise
+// to 1/256. A coarse tat wraps around, but a valid one is never more
+// than credit_max ahead of now, anything else is a stale bucket. Both
+// use integer arithmetic only.
+//
+// Atomic tables are direct-mapped tables that may be shared by any
+// number of threads. Each bucket is a single word, the time at which
+// its credit was zero, updated with compare-and-swap, and is padded to
+// a cache line. When several buckets are charged together, atomic
+// buckets are charged one by one and refunded if a later one refuses.
+// A concurrent check may therefore see a refund not yet done and
+// refuse, but no bucket is ever overdrawn.
+//
+// Nothing is specific to packets: touch_cost is the credit of one unit
+// of the rate, and every bucket handle carries the number of units it
+// is charged. A table with a rate in bytes per second charged with the
+// frame length limits bandwidth.
+//
+// A table of any layout can be moved into a memory mapped file with
+// hashlimit_map(). struct hashlimit holds no pointers, so the file is
+// simply the struct followed by the buckets, and the header records
+// everything needed to tell whether a file left by a previous run can
+// be reused: the layout, size, rates, the hash and its key. Timestamps
+// are monotonic, so the state is only valid until the next reboot, the
+// kernel boot id is stored too.
+//
+// Exact tables can be grown while in use. The new table takes over all
+// the lookups, and an entry moves over from the old one when its key
+// is first looked up, or when hashlimit_resize_step() gets to it, a
+// few slots at a time. Nothing is lost and no single step takes long.
+//
+// Files, or named shared memory segments, may be mapped by several
+// processes at once. Atomic tables are then shared just like between
+// threads, all the processes enforcing the same budgets.
 
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 #include <time.h>
 #include <unistd.h>
 
+#include "hashlimit.h"
+
 uint64_t siphash24(const void *src, unsigned long src_sz,
 		   const unsigned char key[16]);
+void siphash24_batch(const uint8_t *const *src, unsigned long src_sz,
+		     const unsigned char key[16], uint64_t *out, unsigned n);
 
 #define TIMESPEC_NSEC(ts) ((ts)->tv_sec * 1000000000ULL + (ts)->tv_nsec)
 #define MSEC_NSEC(ms) ((ms)*1000000ULL)
@@ -27,31 +105,122 @@ inline static uint64_t realtime_now()
 	return TIMESPEC_NSEC(&now);
 }
 
+#define HL_PROBE 8
+
+/* Coarse GCRA cells hold the low 32 bits of tat. A valid tat must stay
+ * within half of the wrap window to be told apart from a stale one. */
+#define HL_COARSE_AHEAD_MAX (1ULL << 31)
+
+/* Change the last byte whenever the layout of the file changes */
+#define HL_MAGIC "pmtudhl\x05"
+
+enum hl_type { HL_DIRECT, HL_EXACT, HL_SKETCH, HL_ATOMIC, HL_GCRA };
+
 struct hl_item
 {
 	uint64_t credit;
 	uint64_t prev;
 };
 
+/* Credit at time now is min(credit_max, now - zero_at) */
+struct hl_atomic
+{
+	uint64_t zero_at;
+	uint8_t pad[56];
+} __attribute__((aligned(64)));
+
+struct hl_entry
+{
+	uint8_t key[16];
+	/* 0 for an empty slot */
+	uint8_t key_len;
+	uint8_t referenced;
+	/* Taken over by the new table, in a table being resized */
+	uint8_t moved;
+
+	struct hl_item item;
+};
+
 struct hashlimit
 {
+	char magic[8];
+	char boot_id[40];
+	/* Bytes, including this header */
+	uint64_t total_size;
+	unsigned item_size;
+	/* Set when the table lives in a mapped file */
+	int mapped;
+
+	enum hl_type type;
+	/* Buckets per row, depth is 1 for all but sketch tables */
 	unsigned size;
+	unsigned depth;
+	enum hl_hash hash;
 
+	/* In 2^shift ns units, shift may only be nonzero in coarse GCRA
+	 * tables */
 	uint64_t credit_max;
 	uint64_t touch_cost;
+	unsigned shift;
+	/* As allocated, before any hashlimit_set_rate() */
+	uint64_t conf_credit_max;
+	uint64_t conf_touch_cost;
+	/* Largest credit_max ever set, coarse GCRA tables only */
+	uint64_t ahead_max;
 	uint8_t key[16];
 
-	struct hl_item items[0];
+	unsigned occupancy;
+	/* Entries are still moving over from a smaller table */
+	int resizing;
+	uint64_t evictions;
+	uint64_t forced_evictions;
+
+	uint8_t row_keys[HL_DEPTH_MAX][16];
+	/* Multipliers of multshift, derived from the key of each row */
+	uint64_t mult_keys[HL_DEPTH_MAX][HL_MULT_KEYS];
+
+	struct hl_item items[0] __attribute__((aligned(64)));
 };
 
-struct hashlimit *hashlimit_alloc(unsigned size, double rate_pps, double burst)
+static enum hl_hash hash_function = HL_HASH_SIPHASH24;
+
+void hashlimit_hash_function(enum hl_hash hash) { hash_function = hash; }
+
+/* Key of a sketch row, or of the whole table */
+static const uint8_t *row_key(struct hashlimit *hl, unsigned row)
+{
+	return hl->type == HL_SKETCH ? hl->row_keys[row] : hl->key;
+}
+
+inline static uint64_t key_hash(struct hashlimit *hl, unsigned row,
+				const uint8_t *h, int h_len)
+{
+	return hashlimit_hash(hl->hash, h, h_len, row_key(hl, row),
+			      hl->mult_keys[row]);
+}
+
+static struct hashlimit *hl_alloc(enum hl_type type, unsigned size,
+				  unsigned depth, size_t item_size,
+				  double rate_pps, double burst)
 {
-	struct hashlimit *hl = calloc(1, sizeof(struct hashlimit) +
-						 size * sizeof(struct hl_item));
+	size_t hl_size =
+		sizeof(struct hashlimit) + (size_t)size * depth * item_size;
+	struct hashlimit *hl;
+	if (posix_memalign((void **)&hl, 64, hl_size) != 0) {
+		abort();
+	}
+	memset(hl, 0, hl_size);
 
+	memcpy(hl->magic, HL_MAGIC, sizeof(hl->magic));
+	hl->total_size = hl_size;
+	hl->item_size = item_size;
+	hl->type = type;
 	hl->size = size;
+	hl->depth = depth;
 	hl->touch_cost = (double)(MSEC_NSEC(1000ULL)) / rate_pps;
 	hl->credit_max = burst * hl->touch_cost;
+	hl->conf_touch_cost = hl->touch_cost;
+	hl->conf_credit_max = hl->credit_max;
 
 	/* Random numbers for poor */
 	uint64_t a = realtime_now() | getpid();
@@ -59,46 +228,893 @@ struct hashlimit *hashlimit_alloc(unsigned size, double rate_pps, double burst)
 	a = realtime_now() | getppid();
 	memcpy(&hl->key[8], &a, 8);
 
+	/* Independent row keys derived from the table key */
+	unsigned i;
+	for (i = 0; i < depth; i++) {
+		uint8_t row[2] = {i, 0};
+		a = siphash24(row, sizeof(row), hl->key);
+		memcpy(&hl->row_keys[i][0], &a, 8);
+		row[1] = 1;
+		a = siphash24(row, sizeof(row), hl->key);
+		memcpy(&hl->row_keys[i][8], &a, 8);
+	}
+	hl->hash = hash_function;
+	for (i = 0; i < depth; i++) {
+		multshift_keys(row_key(hl, i), hl->mult_keys[i]);
+	}
+
 	return hl;
 }
 
-void hashlimit_free(struct hashlimit *hl) { free(hl); }
+struct hashlimit *hashlimit_alloc(unsigned size, double rate_pps, double burst)
+{
+	return hl_alloc(HL_DIRECT, size, 1, sizeof(struct hl_item), rate_pps,
+			burst);
+}
 
-int hashlimit_check(struct hashlimit *hl, unsigned idx)
+struct hashlimit *hashlimit_alloc_exact(unsigned size, double rate_pps,
+					double burst)
+{
+	if (size < HL_PROBE) {
+		size = HL_PROBE;
+	}
+	return hl_alloc(HL_EXACT, size, 1, sizeof(struct hl_entry), rate_pps,
+			burst);
+}
+
+struct hashlimit *hashlimit_alloc_atomic(unsigned size, double rate_pps,
+					 double burst)
+{
+	return hl_alloc(HL_ATOMIC, size, 1, sizeof(struct hl_atomic),
+			rate_pps, burst);
+}
+
+struct hashlimit *hashlimit_alloc_gcra(unsigned size, double rate_pps,
+				       double burst)
+{
+	return hl_alloc(HL_GCRA, size, 1, sizeof(uint64_t), rate_pps, burst);
+}
+
+/* Cells of 4 bytes, the unit may still be 1ns at high rates */
+static int gcra_coarse(struct hashlimit *hl)
 {
-	struct hl_item *item = &hl->items[idx];
+	return hl->type == HL_GCRA && hl->item_size == sizeof(uint32_t);
+}
+
+struct hashlimit *hashlimit_alloc_gcra_coarse(unsigned size, double rate_pps,
+					      double burst)
+{
+	struct hashlimit *hl =
+		hl_alloc(HL_GCRA, size, 1, sizeof(uint32_t), rate_pps, burst);
+	while ((hl->touch_cost >> (hl->shift + 1)) >= 256) {
+		hl->shift += 1;
+	}
+	hl->touch_cost >>= hl->shift;
+	hl->credit_max >>= hl->shift;
+	if (hl->credit_max > HL_COARSE_AHEAD_MAX) {
+		free(hl);
+		errno = ERANGE;
+		return NULL;
+	}
+	hl->conf_touch_cost = hl->touch_cost;
+	hl->conf_credit_max = hl->credit_max;
+	hl->ahead_max = hl->credit_max;
+	return hl;
+}
+
+struct hashlimit *hashlimit_alloc_sketch(unsigned width, unsigned depth,
+					 double rate_pps, double burst)
+{
+	if (depth < 1 || depth > HL_DEPTH_MAX) {
+		return NULL;
+	}
+	return hl_alloc(HL_SKETCH, width, depth, sizeof(struct hl_item),
+			rate_pps, burst);
+}
 
-	uint64_t now = realtime_now();
-	uint64_t delta = now - item->prev;
-	item->credit += delta;
-	item->prev = now;
+void hashlimit_set_rate(struct hashlimit *hl, double rate_pps, double burst)
+{
+	uint64_t touch_cost = (double)(MSEC_NSEC(1000ULL)) / rate_pps;
+	uint64_t credit_max = burst * touch_cost;
+
+	/* Keep the unit of coarse tables, stored times depend on it */
+	touch_cost >>= hl->shift;
+	credit_max >>= hl->shift;
+	if (touch_cost == 0) {
+		touch_cost = 1;
+	}
+	if (gcra_coarse(hl) && credit_max > HL_COARSE_AHEAD_MAX) {
+		credit_max = HL_COARSE_AHEAD_MAX;
+	}
+	if (credit_max > hl->ahead_max) {
+		hl->ahead_max = credit_max;
+	}
+
+	/* Buckets above the new credit_max are clamped on next use */
+	__atomic_store_n(&hl->touch_cost, touch_cost, __ATOMIC_RELAXED);
+	__atomic_store_n(&hl->credit_max, credit_max, __ATOMIC_RELAXED);
+}
+
+/* Mapped tables of this process, with the descriptor holding the lock
+ * on the file. */
+struct hl_mapping
+{
+	struct hashlimit *hl;
+	int fd;
+	struct hl_mapping *next;
+};
+
+static struct hl_mapping *mappings;
+
+/* Exact tables being grown, and the table their entries move over
+ * from. Also process local. */
+struct hl_resizing
+{
+	struct hashlimit *from;
+	struct hashlimit *to;
+	/* Next slot of from to migrate */
+	unsigned pos;
+	struct hl_resizing *next;
+};
+
+static struct hl_resizing *resizings;
+
+static struct hl_resizing *resizing_of(struct hashlimit *hl)
+{
+	struct hl_resizing *r = resizings;
+	for (; r; r = r->next) {
+		if (r->to == hl) {
+			break;
+		}
+	}
+	return r;
+}
+
+static void resizing_done(struct hl_resizing *r)
+{
+	struct hl_resizing **p = &resizings;
+	for (; *p; p = &(*p)->next) {
+		if (*p == r) {
+			*p = r->next;
+			break;
+		}
+	}
+	r->to->resizing = 0;
+	hashlimit_free(r->from);
+	free(r);
+}
+
+void hashlimit_free(struct hashlimit *hl)
+{
+	if (hl->resizing) {
+		resizing_done(resizing_of(hl));
+	}
+
+	if (hl->mapped == 0) {
+		free(hl);
+		return;
+	}
+
+	struct hl_mapping **m = &mappings;
+	for (; *m; m = &(*m)->next) {
+		if ((*m)->hl == hl) {
+			struct hl_mapping *found = *m;
+			*m = found->next;
+			close(found->fd);
+			free(found);
+			break;
+		}
+	}
+	munmap(hl, hl->total_size);
+}
+
+static int read_boot_id(char boot_id[40])
+{
+	memset(boot_id, 0, 40);
+	int fd = open("/proc/sys/kernel/random/boot_id", O_RDONLY);
+	if (fd < 0) {
+		return -1;
+	}
+	int r = read(fd, boot_id, 39);
+	close(fd);
+	return r < 36 ? -1 : 0;
+}
+
+/* Same parameters means same layout, the key is taken from the file */
+static int hl_compatible(struct hashlimit *a, struct hashlimit *b)
+{
+	return memcmp(a->magic, b->magic, sizeof(a->magic)) == 0 &&
+	       memcmp(a->boot_id, b->boot_id, sizeof(a->boot_id)) == 0 &&
+	       a->total_size == b->total_size &&
+	       a->item_size == b->item_size && a->type == b->type &&
+	       a->size == b->size && a->depth == b->depth &&
+	       a->hash == b->hash &&
+	       a->conf_credit_max == b->conf_credit_max &&
+	       a->conf_touch_cost == b->conf_touch_cost;
+}
+
+/* Bytes of the file used as locks. Open file description locks are
+ * used, they belong to the descriptor, like flock(), but a lock is
+ * never converted from one type to another. */
+#define HL_LOCK_INIT 0
+#define HL_LOCK_USE 1
+
+static int hl_lock(int fd, int cmd, short type, off_t byte)
+{
+	struct flock fl;
+	memset(&fl, 0, sizeof(fl));
+	fl.l_type = type;
+	fl.l_whence = SEEK_SET;
+	fl.l_start = byte;
+	fl.l_len = 1;
+	if (fcntl(fd, cmd, &fl) < 0) {
+		return -1;
+	}
+	return fl.l_type;
+}
+
+/* Every process using the file holds a read lock on HL_LOCK_USE for as
+ * long as the table is mapped. The file is checked, and initialized,
+ * under the write lock on HL_LOCK_INIT, so processes mapping it at the
+ * same time take turns. A process that sees no one else using the file
+ * is alone and may reinitialize it, otherwise the file must hold a
+ * compatible table. */
+static struct hashlimit *hl_map_fd(struct hashlimit *hl, int fd,
+				   int *reused)
+{
+	struct hl_mapping *mapping = NULL;
+	*reused = 0;
+
+	if (hl_lock(fd, F_OFD_SETLKW, F_WRLCK, HL_LOCK_INIT) < 0 ||
+	    hl_lock(fd, F_OFD_SETLKW, F_RDLCK, HL_LOCK_USE) < 0) {
+		goto error;
+	}
+	/* Our own read lock doesn't conflict */
+	int users = hl_lock(fd, F_OFD_GETLK, F_WRLCK, HL_LOCK_USE);
+	if (users < 0) {
+		goto error;
+	}
+	int alone = users == F_UNLCK;
+
+	struct stat st;
+	if (fstat(fd, &st) < 0) {
+		goto error;
+	}
+
+	int booted = read_boot_id(hl->boot_id) == 0;
+	int resize = (uint64_t)st.st_size != hl->total_size;
+	if (!alone && resize) {
+		errno = EBUSY;
+		goto error;
+	}
+	if (resize && ftruncate(fd, hl->total_size) < 0) {
+		goto error;
+	}
+
+	struct hashlimit *m = mmap(NULL, hl->total_size,
+				   PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (m == MAP_FAILED) {
+		goto error;
+	}
+
+	if (!resize && booted && hl_compatible(m, hl)) {
+		*reused = 1;
+		if (alone) {
+			/* Drop whatever rate the last user adapted to */
+			m->credit_max = hl->credit_max;
+			m->touch_cost = hl->touch_cost;
+		}
+	} else if (alone) {
+		/* Nothing usable in the file, start from the fresh table.
+		 * Without a boot id the file is never reused. */
+		memcpy(m, hl, hl->total_size);
+		m->mapped = 1;
+	} else {
+		munmap(m, hl->total_size);
+		errno = EBUSY;
+		goto error;
+	}
+
+	if (hl_lock(fd, F_OFD_SETLK, F_UNLCK, HL_LOCK_INIT) < 0) {
+		munmap(m, hl->total_size);
+		goto error;
+	}
+
+	mapping = calloc(1, sizeof(struct hl_mapping));
+	mapping->hl = m;
+	mapping->fd = fd;
+	mapping->next = mappings;
+	mappings = mapping;
+
+	hashlimit_free(hl);
+	return m;
+
+error:;
+	int saved_errno = errno;
+	close(fd);
+	errno = saved_errno;
+	return NULL;
+}
+
+struct hashlimit *hashlimit_map(struct hashlimit *hl, const char *path,
+				int *reused)
+{
+	int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+	if (fd < 0) {
+		return NULL;
+	}
+	return hl_map_fd(hl, fd, reused);
+}
+
+struct hashlimit *hashlimit_map_shm(struct hashlimit *hl, const char *name,
+				    int *reused)
+{
+	int fd = shm_open(name, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+	if (fd < 0) {
+		return NULL;
+	}
+	return hl_map_fd(hl, fd, reused);
+}
+
+static void refill(struct hashlimit *hl, struct hl_item *item, uint64_t now)
+{
+	/* Clocks are monotonic, but a TSC read on another core may
+	 * still be slightly behind. */
+	if (now > item->prev) {
+		item->credit += now - item->prev;
+		item->prev = now;
+	}
 
 	if (item->credit > hl->credit_max) {
 		item->credit = hl->credit_max;
 	}
+}
 
-	return item->credit >= hl->touch_cost;
+static uint64_t atomic_credit(struct hashlimit *hl, struct hl_atomic *a,
+			      uint64_t now)
+{
+	uint64_t zero_at = __atomic_load_n(&a->zero_at, __ATOMIC_RELAXED);
+	if (now <= zero_at) {
+		return 0;
+	}
+	if (now - zero_at > hl->credit_max) {
+		return hl->credit_max;
+	}
+	return now - zero_at;
 }
 
-int hashlimit_check_hash(struct hashlimit *hl, const uint8_t *h, int h_len)
+static int atomic_charge(struct hashlimit *hl, struct hl_atomic *a,
+			 uint64_t now, uint64_t charge)
 {
+	uint64_t floor = now > hl->credit_max ? now - hl->credit_max : 0;
+	uint64_t zero_at = __atomic_load_n(&a->zero_at, __ATOMIC_RELAXED);
+	uint64_t next;
+	do {
+		next = (zero_at > floor ? zero_at : floor) + charge;
+		if (next > now) {
+			return 0;
+		}
+	} while (!__atomic_compare_exchange_n(&a->zero_at, &zero_at, next, 1,
+					      __ATOMIC_RELAXED,
+					      __ATOMIC_RELAXED));
+	return 1;
+}
 
-	uint64_t hash = siphash24(h, h_len, hl->key);
-	return hashlimit_check(hl, hash % hl->size);
+static void atomic_refund(struct hashlimit *hl, struct hl_atomic *a,
+			  uint64_t charge)
+{
+	__atomic_fetch_sub(&a->zero_at, charge, __ATOMIC_RELAXED);
 }
 
-int hashlimit_subtract(struct hashlimit *hl, unsigned idx)
+/* Time of the next conforming packet, never behind now */
+static uint64_t gcra_tat(struct hashlimit *hl, struct hl_item *cell,
+			 uint64_t now)
+{
+	if (!gcra_coarse(hl)) {
+		uint64_t tat = *(uint64_t *)cell;
+		if (tat <= now) {
+			return now;
+		}
+		/* A TSC read on another core may be slightly behind */
+		return tat - now > hl->credit_max ? now + hl->credit_max : tat;
+	}
+
+	uint32_t ahead = *(uint32_t *)cell - (uint32_t)now;
+	if (ahead > hl->ahead_max) {
+		/* Behind now, or stale and wrapped around */
+		ahead = 0;
+	}
+	return now + (ahead > hl->credit_max ? hl->credit_max : ahead);
+}
+
+static void gcra_store(struct hashlimit *hl, struct hl_item *cell,
+		       uint64_t tat)
+{
+	if (!gcra_coarse(hl)) {
+		*(uint64_t *)cell = tat;
+	} else {
+		*(uint32_t *)cell = tat;
+	}
+}
+
+/* Credit taken by a packet, cost is in units of the table rate */
+static uint64_t bucket_charge_of(struct hl_bucket *b)
+{
+	return b->hl->touch_cost * b->cost;
+}
+
+/* Credit of the bucket: the best estimate over all of its cells. */
+static uint64_t estimate(struct hl_bucket *b)
+{
+	uint64_t credit = b->item[0]->credit;
+	unsigned i;
+	for (i = 1; i < b->hl->depth; i++) {
+		if (b->item[i]->credit > credit) {
+			credit = b->item[i]->credit;
+		}
+	}
+	return credit;
+}
+
+static uint64_t bucket_refill(struct hl_bucket *b, uint64_t now)
+{
+	unsigned i;
+	for (i = 0; i < b->hl->depth; i++) {
+		refill(b->hl, b->item[i], now);
+	}
+	return estimate(b);
+}
+
+/* Conservative update, no cell is lowered below the new estimate. */
+static void bucket_charge(struct hl_bucket *b, uint64_t credit)
+{
+	uint64_t left = credit - bucket_charge_of(b);
+	unsigned i;
+	for (i = 0; i < b->hl->depth; i++) {
+		if (b->item[i]->credit > left) {
+			b->item[i]->credit = left;
+		}
+	}
+}
+
+/* Credit of a bucket of any table but atomic */
+static uint64_t bucket_credit(struct hl_bucket *b, uint64_t now)
 {
-	struct hl_item *item = &hl->items[idx];
-	if (item->credit >= hl->touch_cost) {
-		item->credit -= hl->touch_cost;
+	struct hashlimit *hl = b->hl;
+	if (hl->type == HL_GCRA) {
+		now >>= hl->shift;
+		return hl->credit_max - (gcra_tat(hl, b->item[0], now) - now);
+	}
+	return bucket_refill(b, now);
+}
+
+static void bucket_commit(struct hl_bucket *b, uint64_t credit, uint64_t now)
+{
+	struct hashlimit *hl = b->hl;
+	if (hl->type == HL_GCRA) {
+		now >>= hl->shift;
+		uint64_t tat = now + hl->credit_max - credit;
+		gcra_store(hl, b->item[0], tat + bucket_charge_of(b));
+		return;
+	}
+	bucket_charge(b, credit);
+}
+
+static int bucket_check(struct hl_bucket *b)
+{
+	uint64_t now = hashlimit_now();
+	if (b->hl->type == HL_ATOMIC) {
+		return atomic_credit(b->hl, (struct hl_atomic *)b->item[0],
+				     now) >= bucket_charge_of(b);
+	}
+	return bucket_credit(b, now) >= bucket_charge_of(b);
+}
+
+static int bucket_subtract(struct hl_bucket *b)
+{
+	uint64_t now = hashlimit_now();
+	if (b->hl->type == HL_ATOMIC) {
+		return atomic_charge(b->hl, (struct hl_atomic *)b->item[0],
+				     now, bucket_charge_of(b));
+	}
+
+	uint64_t credit = bucket_credit(b, now);
+	if (credit >= bucket_charge_of(b)) {
+		bucket_commit(b, credit, now);
 		return 1;
 	}
 	return 0;
 }
 
+int hashlimit_check(struct hashlimit *hl, unsigned idx)
+{
+	struct hl_bucket b = {NULL, 1, {NULL}};
+	hashlimit_bucket(hl, idx, &b);
+	return bucket_check(&b);
+}
+
+int hashlimit_check_hash(struct hashlimit *hl, const uint8_t *h, int h_len)
+{
+	struct hl_bucket b = {NULL, 1, {NULL}};
+	hashlimit_bucket_hash(hl, h, h_len, &b);
+	return bucket_check(&b);
+}
+
+int hashlimit_subtract(struct hashlimit *hl, unsigned idx)
+{
+	struct hl_bucket b = {NULL, 1, {NULL}};
+	hashlimit_bucket(hl, idx, &b);
+	return bucket_subtract(&b);
+}
+
 int hashlimit_subtract_hash(struct hashlimit *hl, const uint8_t *h, int h_len)
 {
-	uint64_t hash = siphash24(h, h_len, hl->key);
-	return hashlimit_subtract(hl, hash % hl->size);
+	struct hl_bucket b = {NULL, 1, {NULL}};
+	hashlimit_bucket_hash(hl, h, h_len, &b);
+	return bucket_subtract(&b);
+}
+
+/* Is the bucket full again, as if the key was never seen? */
+static int idle(struct hashlimit *hl, struct hl_item *item, uint64_t now)
+{
+	return now > item->prev &&
+	       item->credit + (now - item->prev) >= hl->credit_max;
+}
+
+/* Entry of the key, if any, without inserting it */
+static struct hl_entry *exact_find(struct hashlimit *hl, const uint8_t *h,
+				   int h_len, uint64_t hash)
+{
+	struct hl_entry *table = (struct hl_entry *)hl->items;
+	unsigned start = hash % hl->size;
+	int i;
+	for (i = 0; i < HL_PROBE; i++) {
+		struct hl_entry *e = &table[(start + i) % hl->size];
+		if (e->key_len == 0) {
+			break;
+		}
+		if (e->key_len == h_len && memcmp(e->key, h, h_len) == 0) {
+			return e->moved ? NULL : e;
+		}
+	}
+	return NULL;
+}
+
+/* Was the entry handed out earlier in the current batch? */
+static int taken(struct hl_entry *e, struct hl_item **taken_items,
+		 int taken_len)
+{
+	int i;
+	for (i = 0; i < taken_len; i++) {
+		if (taken_items[i] == &e->item) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/* Entries already handed out, to taken_len earlier packets of a batch,
+ * are never evicted: two keys would share a bucket until the batch is
+ * consumed. Returns NULL if all of the window is taken. */
+static struct hl_item *exact_lookup(struct hashlimit *hl, const uint8_t *h,
+				    int h_len, uint64_t hash,
+				    struct hl_item **taken_items, int taken_len)
+{
+	struct hl_entry *table = (struct hl_entry *)hl->items;
+	unsigned start = hash % hl->size;
+	struct hl_entry *e = NULL;
+	int i;
+
+	/* Entries are only ever replaced, never removed, so an empty
+	 * slot terminates the probe sequence. */
+	for (i = 0; i < HL_PROBE; i++) {
+		e = &table[(start + i) % hl->size];
+		if (e->key_len == 0) {
+			hl->occupancy += 1;
+			goto insert;
+		}
+		if (e->key_len == h_len && memcmp(e->key, h, h_len) == 0) {
+			e->referenced = 1;
+			return &e->item;
+		}
+	}
+
+	uint64_t now = hashlimit_now();
+	struct hl_entry *victim = NULL;
+	for (i = 0; i < HL_PROBE; i++) {
+		e = &table[(start + i) % hl->size];
+		if (taken(e, taken_items, taken_len)) {
+			continue;
+		}
+		if (idle(hl, &e->item, now)) {
+			victim = e;
+			break;
+		}
+		if (victim == NULL && e->referenced == 0) {
+			victim = e;
+		}
+		e->referenced = 0;
+	}
+	/* All referenced, the first one not taken loses */
+	for (i = 0; victim == NULL && i < HL_PROBE; i++) {
+		e = &table[(start + i) % hl->size];
+		if (!taken(e, taken_items, taken_len)) {
+			victim = e;
+		}
+	}
+	if (victim == NULL) {
+		return NULL;
+	}
+
+	e = victim;
+	if (!idle(hl, &e->item, now)) {
+		hl->forced_evictions += 1;
+	}
+	hl->evictions += 1;
+
+insert:
+	memcpy(e->key, h, h_len);
+	e->key_len = h_len;
+	e->referenced = 1;
+	e->moved = 0;
+	e->item.credit = 0;
+	e->item.prev = 0;
+
+	/* Not seen since the resize started, but maybe before. Entries
+	 * of the old table are marked rather than removed, to keep its
+	 * probe sequences intact. */
+	if (hl->resizing) {
+		struct hl_resizing *r = resizing_of(hl);
+		struct hl_entry *old = exact_find(r->from, h, h_len, hash);
+		if (old) {
+			e->item = old->item;
+			old->moved = 1;
+		}
+	}
+	return &e->item;
+}
+
+struct hashlimit *hashlimit_resize(struct hashlimit *hl, unsigned size)
+{
+	if (hl->type != HL_EXACT || hl->mapped) {
+		errno = EINVAL;
+		return NULL;
+	}
+	if (hl->resizing) {
+		errno = EBUSY;
+		return NULL;
+	}
+
+	struct hashlimit *to = hashlimit_alloc_exact(size, 1.0, 1.0);
+	to->credit_max = hl->credit_max;
+	to->touch_cost = hl->touch_cost;
+	to->conf_credit_max = hl->conf_credit_max;
+	to->conf_touch_cost = hl->conf_touch_cost;
+	/* Same hash, so a key is looked up in both tables at once */
+	to->hash = hl->hash;
+	memcpy(to->key, hl->key, sizeof(to->key));
+	memcpy(to->mult_keys, hl->mult_keys, sizeof(to->mult_keys));
+	to->evictions = hl->evictions;
+	to->forced_evictions = hl->forced_evictions;
+	to->resizing = 1;
+
+	struct hl_resizing *r = calloc(1, sizeof(struct hl_resizing));
+	r->from = hl;
+	r->to = to;
+	r->next = resizings;
+	resizings = r;
+	return to;
+}
+
+int hashlimit_resize_step(struct hashlimit *hl, unsigned n)
+{
+	if (!hl->resizing) {
+		return 0;
+	}
+
+	struct hl_resizing *r = resizing_of(hl);
+	struct hl_entry *table = (struct hl_entry *)r->from->items;
+	uint64_t now = hashlimit_now();
+	for (; n && r->pos < r->from->size; n--, r->pos++) {
+		struct hl_entry *e = &table[r->pos];
+		/* Idle entries are as good as absent, leave them */
+		if (e->key_len == 0 || e->moved ||
+		    idle(r->from, &e->item, now)) {
+			continue;
+		}
+		uint64_t hash = key_hash(hl, 0, e->key, e->key_len);
+		exact_lookup(hl, e->key, e->key_len, hash, NULL, 0);
+	}
+
+	if (r->pos < r->from->size) {
+		return 1;
+	}
+	resizing_done(r);
+	return 0;
+}
+
+void hashlimit_bucket(struct hashlimit *hl, unsigned idx, struct hl_bucket *b)
+{
+	b->hl = hl;
+	b->cost = 1;
+	if (hl->type == HL_EXACT) {
+		struct hl_entry *table = (struct hl_entry *)hl->items;
+		b->item[0] = &table[idx % hl->size].item;
+		return;
+	}
+	/* Direct, atomic and GCRA cells differ only in size */
+	b->item[0] = (struct hl_item *)((uint8_t *)hl->items +
+					(size_t)(idx % hl->size) *
+						hl->item_size);
+}
+
+void hashlimit_bucket_hash(struct hashlimit *hl, const uint8_t *h, int h_len,
+			   struct hl_bucket *b)
+{
+	if (hl->type == HL_SKETCH) {
+		b->hl = hl;
+		b->cost = 1;
+		unsigned i;
+		for (i = 0; i < hl->depth; i++) {
+			uint64_t hash = key_hash(hl, i, h, h_len);
+			b->item[i] = &hl->items[i * hl->size + hash % hl->size];
+		}
+		return;
+	}
+
+	uint64_t hash = key_hash(hl, 0, h, h_len);
+	if (hl->type == HL_EXACT) {
+		b->hl = hl;
+		b->cost = 1;
+		b->item[0] = exact_lookup(hl, h, h_len, hash, NULL, 0);
+		return;
+	}
+	hashlimit_bucket(hl, hash % hl->size, b);
+}
+
+/* Buckets of the keys that found all of their window taken by others in
+ * the batch, forgotten after it. That may only cause a false pass. */
+static __thread struct hl_item *spill;
+static __thread int spill_len;
+
+void hashlimit_bucket_hash_batch(struct hashlimit *hl, const uint8_t **h,
+				 const int *h_len, int n, struct hl_bucket *b,
+				 int stride)
+{
+	uint64_t hash[n];
+	int i;
+
+	/* A burst is usually all IPv4 or all IPv6, hashed in parallel */
+	int same_len = 1;
+	for (i = 1; i < n; i++) {
+		same_len &= h_len[i] == h_len[0];
+	}
+	/* The parallel version is SipHash-2-4 only */
+	int simd = same_len && n > 0 && hl->type != HL_SKETCH &&
+		   hl->hash == HL_HASH_SIPHASH24;
+	if (simd) {
+		siphash24_batch(h, h_len[0], hl->key, hash, n);
+	}
+
+	/* Hash everything and get the cache misses going */
+	for (i = 0; i < n; i++) {
+		struct hl_bucket *bi = &b[i * stride];
+		if (hl->type == HL_SKETCH) {
+			hashlimit_bucket_hash(hl, h[i], h_len[i], bi);
+			unsigned r;
+			for (r = 0; r < hl->depth; r++) {
+				__builtin_prefetch(bi->item[r], 1);
+			}
+			continue;
+		}
+
+		if (!simd) {
+			hash[i] = key_hash(hl, 0, h[i], h_len[i]);
+		}
+		if (hl->type == HL_EXACT) {
+			struct hl_entry *table = (struct hl_entry *)hl->items;
+			__builtin_prefetch(&table[hash[i] % hl->size], 1);
+			continue;
+		}
+		hashlimit_bucket(hl, hash[i] % hl->size, bi);
+		__builtin_prefetch(bi->item[0], 1);
+	}
+
+	if (hl->type != HL_EXACT) {
+		return;
+	}
+	if (spill_len < n) {
+		spill = realloc(spill, n * sizeof(struct hl_item));
+		spill_len = n;
+	}
+	struct hl_item *items[n];
+	for (i = 0; i < n; i++) {
+		struct hl_bucket *bi = &b[i * stride];
+		bi->hl = hl;
+		bi->cost = 1;
+		items[i] = exact_lookup(hl, h[i], h_len[i], hash[i], items, i);
+		if (items[i] == NULL) {
+			/* Full credit, as for any new entry */
+			memset(&spill[i], 0, sizeof(spill[i]));
+			items[i] = &spill[i];
+		}
+		bi->item[0] = items[i];
+	}
+}
+
+/* Refill all the buckets and, only if every one of them has enough
+ * credit, charge all of them. Returns buckets_len on success or the
+ * index of the first bucket that refused, in which case nothing is
+ * charged. */
+int hashlimit_consume(struct hl_bucket *buckets, int buckets_len)
+{
+	uint64_t now = hashlimit_now();
+	uint64_t credit[buckets_len];
+	int i, refused = buckets_len;
+
+	for (i = 0; i < buckets_len; i++) {
+		struct hl_bucket *b = &buckets[i];
+		if (b->hl->type == HL_ATOMIC) {
+			continue;
+		}
+		credit[i] = bucket_credit(b, now);
+		if (refused == buckets_len && credit[i] < bucket_charge_of(b)) {
+			refused = i;
+		}
+	}
+
+	if (refused != buckets_len) {
+		return refused;
+	}
+
+	/* Atomic buckets can only be checked by charging them */
+	for (i = 0; i < buckets_len; i++) {
+		struct hl_bucket *b = &buckets[i];
+		if (b->hl->type != HL_ATOMIC) {
+			continue;
+		}
+		if (!atomic_charge(b->hl, (struct hl_atomic *)b->item[0], now,
+				   bucket_charge_of(b))) {
+			refused = i;
+			break;
+		}
+	}
+
+	if (refused != buckets_len) {
+		for (i = 0; i < refused; i++) {
+			struct hl_bucket *b = &buckets[i];
+			if (b->hl->type == HL_ATOMIC) {
+				atomic_refund(b->hl,
+					      (struct hl_atomic *)b->item[0],
+					      bucket_charge_of(b));
+			}
+		}
+		return refused;
+	}
+
+	for (i = 0; i < buckets_len; i++) {
+		if (buckets[i].hl->type != HL_ATOMIC) {
+			bucket_commit(&buckets[i], credit[i], now);
+		}
+	}
+	return buckets_len;
+}
+
+void hashlimit_consume_batch(struct hl_bucket *buckets, int buckets_len,
+			     int n, int *results)
+{
+	int i;
+	for (i = 0; i < n; i++) {
+		results[i] = hashlimit_consume(&buckets[i * buckets_len],
+					       buckets_len);
+	}
+}
+
+void hashlimit_stats(struct hashlimit *hl, struct hl_stats *stats)
+{
+	stats->size = hl->size * hl->depth;
+	stats->occupancy = hl->occupancy;
+	stats->evictions = hl->evictions;
+	stats->forced_evictions = hl->forced_evictions;
+	stats->resizing = hl->resizing;
 }
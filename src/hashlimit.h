@@ -3,10 +3,144 @@
 // Copyright (c) 2015 CloudFlare, Inc.
 
 struct hashlimit *hashlimit_alloc(unsigned size, double rate_pps, double burst);
+struct hashlimit *hashlimit_alloc_exact(unsigned size, double rate_pps,
+					double burst);
+struct hashlimit *hashlimit_alloc_atomic(unsigned size, double rate_pps,
+					 double burst);
+struct hashlimit *hashlimit_alloc_gcra(unsigned size, double rate_pps,
+				       double burst);
+/* Returns NULL with errno set to ERANGE if the burst is too long to be
+ * told apart from a stale bucket in a 32 bit cell. */
+struct hashlimit *hashlimit_alloc_gcra_coarse(unsigned size, double rate_pps,
+					      double burst);
+struct hashlimit *hashlimit_alloc_sketch(unsigned width, unsigned depth,
+					 double rate_pps, double burst);
 void hashlimit_free(struct hashlimit *hl);
 
+/* Changes the rate of an existing table, keeping the state of all the
+ * buckets. Credit above the new burst is dropped. */
+void hashlimit_set_rate(struct hashlimit *hl, double rate_pps, double burst);
+
+/* Moves the table into a shared mapping of the file at path. If the
+ * file holds a table with the same parameters, left there by a previous
+ * run since the last reboot or by a process still using it, its state
+ * is reused and *reused set. On failure returns NULL with errno set,
+ * and hl is left untouched. EBUSY means the file is in use by another
+ * process with different parameters. */
+struct hashlimit *hashlimit_map(struct hashlimit *hl, const char *path,
+				int *reused);
+/* Same, with a POSIX shared memory segment of the given name */
+struct hashlimit *hashlimit_map_shm(struct hashlimit *hl, const char *name,
+				    int *reused);
+
+/* Starts growing an exact table to size buckets, returning the new
+ * table, to be used instead of hl from now on. Keys move over as they
+ * are looked up, and the rest with hashlimit_resize_step(), which
+ * migrates up to n slots of the old table and returns 0 once done.
+ * The old table is then freed. On failure returns NULL with errno
+ * set: EINVAL for other layouts and mapped tables, EBUSY if a resize
+ * is in progress. */
+struct hashlimit *hashlimit_resize(struct hashlimit *hl, unsigned size);
+int hashlimit_resize_step(struct hashlimit *hl, unsigned n);
+
 int hashlimit_check(struct hashlimit *hl, unsigned idx);
 int hashlimit_check_hash(struct hashlimit *hl, const uint8_t *h, int h_len);
 
 int hashlimit_subtract(struct hashlimit *hl, unsigned idx);
 int hashlimit_subtract_hash(struct hashlimit *hl, const uint8_t *h, int h_len);
+
+/* A bucket handle resolved once per packet. Several handles, possibly
+ * from different limiters, are then checked and charged together by
+ * hashlimit_consume(). */
+struct hl_item;
+
+/* Maximum number of rows of a sketch table */
+#define HL_DEPTH_MAX 8
+
+struct hl_bucket
+{
+	struct hashlimit *hl;
+	/* Units charged, in what the rate is given in: packets for
+	 * packet rate tables, bytes for byte rate ones. Set to 1 by
+	 * the lookup, larger costs must not exceed the burst. */
+	unsigned cost;
+	/* One cell per row, only the first is used unless sketch */
+	struct hl_item *item[HL_DEPTH_MAX];
+};
+
+void hashlimit_bucket(struct hashlimit *hl, unsigned idx, struct hl_bucket *b);
+void hashlimit_bucket_hash(struct hashlimit *hl, const uint8_t *h, int h_len,
+			   struct hl_bucket *b);
+int hashlimit_consume(struct hl_bucket *buckets, int buckets_len);
+
+/* Batch versions for a burst of n packets. Keys of all the packets are
+ * hashed and their buckets prefetched before any is used. Handles are
+ * stored in b[i * stride], so handles from several limiters can be
+ * resolved into one n x buckets_len array, which is then consumed
+ * packet by packet, in order. results[i] is what hashlimit_consume()
+ * returned for packet i. In an exact table, no entry handed out is
+ * evicted by a later packet of the same batch. Handles are valid until
+ * the next batch, or the next lookup outside of one. */
+void hashlimit_bucket_hash_batch(struct hashlimit *hl, const uint8_t **h,
+				 const int *h_len, int n, struct hl_bucket *b,
+				 int stride);
+void hashlimit_consume_batch(struct hl_bucket *buckets, int buckets_len,
+			     int n, int *results);
+
+struct hl_stats
+{
+	unsigned size;
+	/* Used slots, exact tables only */
+	unsigned occupancy;
+	uint64_t evictions;
+	/* Evicted entries that weren't idle yet */
+	uint64_t forced_evictions;
+	/* Entries still moving over from a smaller table */
+	int resizing;
+};
+
+void hashlimit_stats(struct hashlimit *hl, struct hl_stats *stats);
+
+/* Keyed hash picking the bucket of a key, see hlhash.c */
+enum hl_hash {
+	HL_HASH_SIPHASH24,
+	HL_HASH_SIPHASH13,
+	HL_HASH_HALFSIPHASH,
+	HL_HASH_MULTSHIFT
+};
+
+/* Sets the hash of tables allocated from now on. A table keeps its
+ * hash for life, a mapped file is only reused by the same hash. */
+void hashlimit_hash_function(enum hl_hash hash);
+
+/* hlhash.c */
+/* Multiply-shift takes a multiplier per 32 bit word of the key, one
+ * for the length and one added */
+#define HL_MULT_WORDS 16
+#define HL_MULT_KEYS (HL_MULT_WORDS + 2)
+
+uint64_t siphash13(const void *src, unsigned long src_sz,
+		   const unsigned char key[16]);
+uint64_t halfsiphash(const void *src, unsigned long src_sz,
+		     const unsigned char key[16]);
+uint64_t multshift(const void *src, unsigned long src_sz,
+		   const uint64_t mult[HL_MULT_KEYS]);
+void multshift_keys(const unsigned char key[16], uint64_t mult[HL_MULT_KEYS]);
+
+uint64_t hashlimit_hash(enum hl_hash hash, const uint8_t *h, int h_len,
+			const unsigned char key[16],
+			const uint64_t mult[HL_MULT_KEYS]);
+int hashlimit_hash_parse(const char *name, enum hl_hash *hash);
+
+/* hlclock.c */
+enum hl_clock {
+	HL_CLOCK_MONOTONIC,
+	HL_CLOCK_CACHED,
+	HL_CLOCK_COARSE,
+	HL_CLOCK_TSC
+};
+
+int hashlimit_clock_source(enum hl_clock source);
+int hashlimit_clock_parse(const char *name, enum hl_clock *source);
+void hashlimit_clock_cache(uint64_t now_ns);
+uint64_t hashlimit_now();
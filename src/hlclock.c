@@ -0,0 +1,137 @@
+// PMTUD
+//
+// Copyright (c) 2015 CloudFlare, Inc.
+//
+// Clock used by the rate limiters. All sources are monotonic, so NTP
+// steps can't hand out or take away credit. Reading the clock is a
+// considerable part of the per packet cost, hence the cheaper
+// alternatives to a plain clock_gettime():
+//
+//  - cached: timestamp taken once per batch of packets, the event
+//    loop calls hashlimit_clock_cache() before handling a batch,
+//  - coarse: CLOCK_MONOTONIC_COARSE, tick resolution (1-4ms),
+//  - tsc: rdtsc scaled to nanoseconds, calibrated at startup against
+//    CLOCK_MONOTONIC. Requires an invariant TSC, refused without.
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <x86intrin.h>
+#define HAVE_TSC 1
+#endif
+
+#include "hashlimit.h"
+
+#define TIMESPEC_NSEC(ts) ((ts)->tv_sec * 1000000000ULL + (ts)->tv_nsec)
+#define MSEC_NSEC(ms) ((ms)*1000000ULL)
+
+static enum hl_clock clock_source = HL_CLOCK_MONOTONIC;
+/* Every thread handles its own batches */
+static __thread uint64_t cached_ns;
+
+static uint64_t tsc_base;
+static uint64_t tsc_base_ns;
+/* Nanoseconds per cycle, fixed point 32.32 */
+static uint64_t tsc_mult;
+
+static uint64_t posix_now(clockid_t clk_id)
+{
+	struct timespec now;
+	clock_gettime(clk_id, &now);
+	return TIMESPEC_NSEC(&now);
+}
+
+#ifdef HAVE_TSC
+/* Ticking at a constant rate in all power states, CPUID
+ * 0x80000007 EDX bit 8 */
+static int tsc_invariant()
+{
+	unsigned eax, ebx, ecx, edx;
+	if (!__get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx)) {
+		return 0;
+	}
+	return (edx >> 8) & 1;
+}
+
+static void tsc_calibrate()
+{
+	struct timespec ts = {0, MSEC_NSEC(20)};
+
+	uint64_t t0 = posix_now(CLOCK_MONOTONIC);
+	uint64_t c0 = __rdtsc();
+	nanosleep(&ts, NULL);
+	uint64_t t1 = posix_now(CLOCK_MONOTONIC);
+	uint64_t c1 = __rdtsc();
+
+	tsc_mult = ((t1 - t0) << 32) / (c1 - c0);
+	tsc_base = c1;
+	tsc_base_ns = t1;
+}
+#endif
+
+int hashlimit_clock_source(enum hl_clock source)
+{
+	switch (source) {
+	case HL_CLOCK_MONOTONIC:
+	case HL_CLOCK_COARSE:
+		break;
+	case HL_CLOCK_CACHED:
+		cached_ns = posix_now(CLOCK_MONOTONIC);
+		break;
+	case HL_CLOCK_TSC:
+#ifdef HAVE_TSC
+		if (!tsc_invariant()) {
+			return -1;
+		}
+		tsc_calibrate();
+		break;
+#else
+		return -1;
+#endif
+	default:
+		return -1;
+	}
+	clock_source = source;
+	return 0;
+}
+
+int hashlimit_clock_parse(const char *name, enum hl_clock *source)
+{
+	static const char *names[] = {[HL_CLOCK_MONOTONIC] = "monotonic",
+				      [HL_CLOCK_CACHED] = "cached",
+				      [HL_CLOCK_COARSE] = "coarse",
+				      [HL_CLOCK_TSC] = "tsc"};
+	unsigned i;
+	for (i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+		if (strcmp(name, names[i]) == 0) {
+			*source = i;
+			return 0;
+		}
+	}
+	return -1;
+}
+
+void hashlimit_clock_cache(uint64_t now_ns) { cached_ns = now_ns; }
+
+uint64_t hashlimit_now()
+{
+	switch (clock_source) {
+	case HL_CLOCK_CACHED:
+		return cached_ns;
+	case HL_CLOCK_COARSE:
+		return posix_now(CLOCK_MONOTONIC_COARSE);
+#ifdef HAVE_TSC
+	case HL_CLOCK_TSC: {
+		uint64_t delta = __rdtsc() - tsc_base;
+		return tsc_base_ns +
+		       (uint64_t)(((unsigned __int128)delta * tsc_mult) >> 32);
+	}
+#endif
+	default:
+		return posix_now(CLOCK_MONOTONIC);
+	}
+}
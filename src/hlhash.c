@@ -0,0 +1,242 @@
+// PMTUD
+//
+// Copyright (c) 2015 CloudFlare, Inc.
+//
+// Keyed hash functions the rate limiters can pick buckets with. The
+// hash decides which keys share a bucket, so whoever can predict it
+// can aim many sources at one bucket, or one source at many. They
+// trade that resistance for speed:
+//
+//  - siphash24: SipHash-2-4, the default. A PRF, nothing about the
+//    bucket of a key can be learned without the key,
+//  - siphash13: SipHash-1-3, fewer rounds, still no known attack on
+//    its use as a hash table function,
+//  - halfsiphash: HalfSipHash-2-4 on 32 bit words, with a 64 bit key
+//    and a 32 bit result. Only cheaper on 32 bit CPUs, and weaker
+//    against an attacker observing many results,
+//  - multshift: vector multiply-shift (Dietzfelbinger). Strongly
+//    universal for keys of one length, so random sources spread
+//    evenly, but linear: a collision once found yields many more.
+//    Takes a multiplier per 32 bit word of the key, derived from the
+//    table key, and returns 32 bits, mixed to spread sequential keys
+//    over a table of any size.
+//
+// Outputs of the 32 bit functions are enough to pick one of up to
+// 2^32 buckets.
+
+#include <endian.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "hashlimit.h"
+
+uint64_t siphash24(const void *src, unsigned long src_sz,
+		   const unsigned char key[16]);
+uint64_t siphash24_4(const void *src, const unsigned char key[16]);
+uint64_t siphash24_16(const void *src, const unsigned char key[16]);
+
+#define ROTL64(x, b) (uint64_t)(((x) << (b)) | ((x) >> (64 - (b))))
+#define ROTL32(x, b) (uint32_t)(((x) << (b)) | ((x) >> (32 - (b))))
+
+/* Message words and keys are read little endian */
+static inline uint64_t rd64(const uint8_t *p)
+{
+	uint64_t v;
+	memcpy(&v, p, 8);
+	return le64toh(v);
+}
+
+static inline uint32_t rd32(const uint8_t *p)
+{
+	uint32_t v;
+	memcpy(&v, p, 4);
+	return le32toh(v);
+}
+
+/* Tail of the message, fewer than word bytes, little endian */
+static inline uint64_t rd_tail(const uint8_t *p, unsigned long len)
+{
+	uint64_t v = 0;
+	unsigned long i;
+	for (i = 0; i < len; i++) {
+		v |= (uint64_t)p[i] << (8 * i);
+	}
+	return v;
+}
+
+#define SIPROUND(v0, v1, v2, v3)                                               \
+	do {                                                                   \
+		v0 += v1;                                                      \
+		v1 = ROTL64(v1, 13);                                           \
+		v1 ^= v0;                                                      \
+		v0 = ROTL64(v0, 32);                                           \
+		v2 += v3;                                                      \
+		v3 = ROTL64(v3, 16);                                           \
+		v3 ^= v2;                                                      \
+		v0 += v3;                                                      \
+		v3 = ROTL64(v3, 21);                                           \
+		v3 ^= v0;                                                      \
+		v2 += v1;                                                      \
+		v1 = ROTL64(v1, 17);                                           \
+		v1 ^= v2;                                                      \
+		v2 = ROTL64(v2, 32);                                           \
+	} while (0)
+
+uint64_t siphash13(const void *src, unsigned long src_sz,
+		   const unsigned char key[16])
+{
+	const uint8_t *in = src;
+	uint64_t k0 = rd64(&key[0]);
+	uint64_t k1 = rd64(&key[8]);
+	uint64_t v0 = k0 ^ 0x736f6d6570736575ULL;
+	uint64_t v1 = k1 ^ 0x646f72616e646f6dULL;
+	uint64_t v2 = k0 ^ 0x6c7967656e657261ULL;
+	uint64_t v3 = k1 ^ 0x7465646279746573ULL;
+	uint64_t b = (uint64_t)src_sz << 56;
+
+	for (; src_sz >= 8; src_sz -= 8, in += 8) {
+		uint64_t m = rd64(in);
+		v3 ^= m;
+		SIPROUND(v0, v1, v2, v3);
+		v0 ^= m;
+	}
+	b |= rd_tail(in, src_sz);
+
+	v3 ^= b;
+	SIPROUND(v0, v1, v2, v3);
+	v0 ^= b;
+	v2 ^= 0xff;
+	SIPROUND(v0, v1, v2, v3);
+	SIPROUND(v0, v1, v2, v3);
+	SIPROUND(v0, v1, v2, v3);
+	return (v0 ^ v1) ^ (v2 ^ v3);
+}
+
+#define HALFSIPROUND(v0, v1, v2, v3)                                           \
+	do {                                                                   \
+		v0 += v1;                                                      \
+		v1 = ROTL32(v1, 5);                                            \
+		v1 ^= v0;                                                      \
+		v0 = ROTL32(v0, 16);                                           \
+		v2 += v3;                                                      \
+		v3 = ROTL32(v3, 8);                                            \
+		v3 ^= v2;                                                      \
+		v0 += v3;                                                      \
+		v3 = ROTL32(v3, 7);                                            \
+		v3 ^= v0;                                                      \
+		v2 += v1;                                                      \
+		v1 = ROTL32(v1, 13);                                           \
+		v1 ^= v2;                                                      \
+		v2 = ROTL32(v2, 16);                                           \
+	} while (0)
+
+/* Only the first 8 bytes of the key are used */
+uint64_t halfsiphash(const void *src, unsigned long src_sz,
+		     const unsigned char key[16])
+{
+	const uint8_t *in = src;
+	uint32_t k0 = rd32(&key[0]);
+	uint32_t k1 = rd32(&key[4]);
+	uint32_t v0 = k0;
+	uint32_t v1 = k1;
+	uint32_t v2 = k0 ^ 0x6c796765;
+	uint32_t v3 = k1 ^ 0x74656462;
+	uint32_t b = (uint32_t)src_sz << 24;
+
+	for (; src_sz >= 4; src_sz -= 4, in += 4) {
+		uint32_t m = rd32(in);
+		v3 ^= m;
+		HALFSIPROUND(v0, v1, v2, v3);
+		HALFSIPROUND(v0, v1, v2, v3);
+		v0 ^= m;
+	}
+	b |= rd_tail(in, src_sz);
+
+	v3 ^= b;
+	HALFSIPROUND(v0, v1, v2, v3);
+	HALFSIPROUND(v0, v1, v2, v3);
+	v0 ^= b;
+	v2 ^= 0xff;
+	HALFSIPROUND(v0, v1, v2, v3);
+	HALFSIPROUND(v0, v1, v2, v3);
+	HALFSIPROUND(v0, v1, v2, v3);
+	HALFSIPROUND(v0, v1, v2, v3);
+	return v1 ^ v3;
+}
+
+/* The length has a multiplier of its own, so a key and the same key
+ * padded with zeros differ. Words past HL_MULT_WORDS reuse the
+ * multipliers, universality only holds for keys up to 64 bytes. */
+uint64_t multshift(const void *src, unsigned long src_sz,
+		   const uint64_t mult[HL_MULT_KEYS])
+{
+	const uint8_t *in = src;
+	uint64_t h = mult[HL_MULT_KEYS - 1] + mult[0] * src_sz;
+	unsigned i;
+	for (i = 0; src_sz >= 4; src_sz -= 4, in += 4, i++) {
+		h += mult[1 + i % HL_MULT_WORDS] * rd32(in);
+	}
+	if (src_sz) {
+		h += mult[1 + i % HL_MULT_WORDS] * rd_tail(in, src_sz);
+	}
+
+	/* Keys in arithmetic progression, like sequential addresses,
+	 * hash to a lattice that % size folds onto few buckets. A
+	 * bijective mix breaks it up, 32 bit collisions stay as rare. */
+	uint32_t x = h >> 32;
+	x ^= x >> 16;
+	x *= 0x85ebca6b;
+	x ^= x >> 13;
+	return x;
+}
+
+void multshift_keys(const unsigned char key[16], uint64_t mult[HL_MULT_KEYS])
+{
+	unsigned i;
+	for (i = 0; i < HL_MULT_KEYS; i++) {
+		uint8_t ctr[4] = {'m', 's', i, 0};
+		mult[i] = siphash24(ctr, sizeof(ctr), key);
+	}
+}
+
+uint64_t hashlimit_hash(enum hl_hash hash, const uint8_t *h, int h_len,
+			const unsigned char key[16],
+			const uint64_t mult[HL_MULT_KEYS])
+{
+	switch (hash) {
+	case HL_HASH_SIPHASH13:
+		return siphash13(h, h_len, key);
+	case HL_HASH_HALFSIPHASH:
+		return halfsiphash(h, h_len, key);
+	case HL_HASH_MULTSHIFT:
+		return multshift(h, h_len, mult);
+	case HL_HASH_SIPHASH24:
+		break;
+	}
+
+	/* Keys are almost always an IPv4 or IPv6 address */
+	switch (h_len) {
+	case 4:
+		return siphash24_4(h, key);
+	case 16:
+		return siphash24_16(h, key);
+	default:
+		return siphash24(h, h_len, key);
+	}
+}
+
+int hashlimit_hash_parse(const char *name, enum hl_hash *hash)
+{
+	static const char *names[] = {[HL_HASH_SIPHASH24] = "siphash24",
+				      [HL_HASH_SIPHASH13] = "siphash13",
+				      [HL_HASH_HALFSIPHASH] = "halfsiphash",
+				      [HL_HASH_MULTSHIFT] = "multshift"};
+	unsigned i;
+	for (i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+		if (strcmp(name, names[i]) == 0) {
+			*hash = i;
+			return 0;
+		}
+	}
+	return -1;
+}
@@ -0,0 +1,172 @@
+// PMTUD
+//
+// Copyright (c) 2015 CloudFlare, Inc.
+//
+// Composition of rate limiter keys from parsed packet fields. The
+// fields of a PTB are parsed once, and every limiter then gathers the
+// ones it is keyed on into a fixed width buffer:
+//
+//    +---------------------+-----------------------------------+
+//    | families (u8)       | bit 0: src is IPv6                |
+//    |                     | bit 1: inner addresses are IPv6   |
+//    +---------------------+-----------------------------------+
+//    | src        (16)     | outer source, the router          |
+//    | dst        (16)     | inner destination, the client     |
+//    | inner-src  (16)     | inner source, our address         |
+//    | proto      (u8)     | inner L4 protocol                 |
+//    | sport      (u16)    | inner L4 source port              |
+//    | dport      (u16)    | inner L4 destination port         |
+//    | vlan       (u16)    | VLAN id, 0 if untagged            |
+//    | mtu        (u32)    | advertised MTU of next hop        |
+//    +---------------------+-----------------------------------+
+//
+// Only the selected fields are present, in this order. IPv4 addresses
+// are zero padded. Fields missing from the packet are zero.
+
+#include <getopt.h>
+#include <pcap.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "pmtud.h"
+
+static const struct
+{
+	const char *name;
+	unsigned fields;
+} field_names[] = {
+	{"src", LK_SRC},
+	{"dst", LK_DST},
+	{"inner-src", LK_INNER_SRC},
+	{"proto", LK_PROTO},
+	{"sport", LK_SPORT},
+	{"dport", LK_DPORT},
+	{"5tuple", LK_5TUPLE},
+	{"vlan", LK_VLAN},
+	{"mtu", LK_MTU},
+};
+
+int limitkey_parse(const char *spec, unsigned *fields)
+{
+	const char **org_names = parse_argv(spec, ',');
+	const char **names = org_names;
+	*fields = 0;
+	for (; names[0] != NULL; names++) {
+		unsigned i, n = sizeof(field_names) / sizeof(field_names[0]);
+		for (i = 0; i < n; i++) {
+			if (strcmp(names[0], field_names[i].name) == 0) {
+				*fields |= field_names[i].fields;
+				break;
+			}
+		}
+		if (i == n) {
+			free(org_names);
+			return -1;
+		}
+	}
+	free(org_names);
+	return *fields ? 0 : -1;
+}
+
+void limitkey_fields(struct pkt_fields *f, const uint8_t *p,
+		     unsigned data_len, unsigned l3_offset,
+		     unsigned icmp_offset)
+{
+	memset(f, 0, sizeof(struct pkt_fields));
+	f->proto = -1;
+	f->sport = -1;
+	f->dport = -1;
+	f->mtu = -1;
+
+	if (l3_offset == 18) {
+		f->vlan = (((uint16_t)p[14] << 8) | p[15]) & 0x0fff;
+	}
+
+	if ((p[l3_offset] & 0xF0) == 0x40) {
+		f->src = &p[l3_offset + 12];
+		f->src_len = 4;
+	} else {
+		f->src = &p[l3_offset + 8];
+		f->src_len = 16;
+	}
+
+	/* Optimistic parsing of the ICMP payload, same as for --ports */
+	unsigned offset = icmp_offset + 8;
+	unsigned l4_offset;
+	if (data_len >= offset + 20 && (p[offset] & 0xF0) == 0x40) {
+		f->inner_src = &p[offset + 12];
+		f->inner_dst = &p[offset + 16];
+		f->inner_len = 4;
+		f->proto = p[offset + 9];
+		l4_offset = offset + (p[offset] & 0x0F) * 4;
+	} else if (data_len >= offset + 40 && (p[offset] & 0xF0) == 0x60) {
+		f->inner_src = &p[offset + 8];
+		f->inner_dst = &p[offset + 24];
+		f->inner_len = 16;
+		f->proto = p[offset + 6];
+		l4_offset = offset + 40;
+	} else {
+		return;
+	}
+
+	/* TCP, UDP, DCCP, SCTP and UDP-Lite all start with the ports */
+	if ((f->proto == 6 || f->proto == 17 || f->proto == 33 ||
+	     f->proto == 132 || f->proto == 136) &&
+	    data_len >= l4_offset + 4) {
+		f->sport = ((uint16_t)p[l4_offset] << 8) | p[l4_offset + 1];
+		f->dport = ((uint16_t)p[l4_offset + 2] << 8) | p[l4_offset + 3];
+	}
+}
+
+static uint8_t *put_addr(uint8_t *k, const uint8_t *addr, int addr_len)
+{
+	memset(k, 0, 16);
+	if (addr) {
+		memcpy(k, addr, addr_len);
+	}
+	return k + 16;
+}
+
+static uint8_t *put_u16(uint8_t *k, int v)
+{
+	v = v < 0 ? 0 : v;
+	k[0] = v >> 8;
+	k[1] = v;
+	return k + 2;
+}
+
+int limitkey_compose(unsigned fields, const struct pkt_fields *f,
+		     uint8_t key[LIMITKEY_MAX])
+{
+	uint8_t *k = key;
+	*k++ = (f->src_len == 16) | (f->inner_len == 16) << 1;
+
+	if (fields & LK_SRC) {
+		k = put_addr(k, f->src, f->src_len);
+	}
+	if (fields & LK_DST) {
+		k = put_addr(k, f->inner_dst, f->inner_len);
+	}
+	if (fields & LK_INNER_SRC) {
+		k = put_addr(k, f->inner_src, f->inner_len);
+	}
+	if (fields & LK_PROTO) {
+		*k++ = f->proto < 0 ? 0 : f->proto;
+	}
+	if (fields & LK_SPORT) {
+		k = put_u16(k, f->sport);
+	}
+	if (fields & LK_DPORT) {
+		k = put_u16(k, f->dport);
+	}
+	if (fields & LK_VLAN) {
+		k = put_u16(k, f->vlan);
+	}
+	if (fields & LK_MTU) {
+		uint32_t mtu = f->mtu < 0 ? 0 : f->mtu;
+		k = put_u16(k, mtu >> 16);
+		k = put_u16(k, mtu & 0xffff);
+	}
+	return k - key;
+}
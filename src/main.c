@@ -4,6 +4,7 @@
 
 #include <errno.h>
 #include <getopt.h>
+#include <limits.h>
 #include <pcap.h>
 #include <signal.h>
 #include <stdint.h>
@@ -12,14 +13,39 @@
 #include <string.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "hashlimit.h"
+#include "pktpool.h"
 #include "pmtud.h"
 #include "uevent.h"
 
 #define IFACE_RATE_PPS 10.0
 #define SRC_RATE_PPS 1.1
+#define SRC_TABLE_SIZE 8191
+#define SRC_SKETCH_DEPTH 4
+/* Two-level mode, the source is then the router sending PTBs for its
+ * clients. Forwarded in proportion to its clients up to about 90 of
+ * them, the router rate only caps what a single router may take. */
+#define ROUTER_RATE_PPS 100.0
+#define CLIENT_RATE_PPS 1.1
+/* Limiters count whole nanoseconds per unit of rate, above this a byte
+ * rate would be rounded by more than 1% */
+#define BYTE_RATE_MAX 1e7
+/* Additional limiters with composed keys, --limit option */
+#define LIMITERS_MAX 4
+/* Per VLAN interface limits, --vlan-rate option */
+#define VLAN_RATES_MAX 8
+#define VLAN_IDS 4096
+
+/* Shadow limiter profiles, --shadow option, exported every interval */
+#define SHADOWS_MAX 4
+#define SHADOW_INTERVAL_MS 10000
+
+/* Heavy hitters of ratelimited packets, exported every interval */
+#define TOPK_SIZE 64
+#define TOPK_INTERVAL_MS 10000
 
 static void usage()
 {
@@ -45,6 +71,99 @@ static void usage()
 		"  --iface-rate         Pps limit to send on a single "
 		"interface "
 		"(default=%.1f pps)\n"
+		"  --src-byte-rate      Bytes per second limit from single "
+		"source,\n"
+		"                       counting whole frames\n"
+		"  --iface-byte-rate    Bytes per second limit to send on a "
+		"single\n"
+		"                       interface, counting whole frames\n"
+		"  --iface-vlan         Give every egress VLAN its own "
+		"interface\n"
+		"                       budget, untagged frames count as "
+		"VLAN 0\n"
+		"  --vlan-rate          Pps limit of a VLAN, as "
+		"VLAN:RATE[:BURST].\n"
+		"                       Implies --iface-vlan. May be given "
+		"up to\n"
+		"                       %i times\n"
+		"  --src-burst          Packets a single source may send at "
+		"once\n"
+		"                       (default=1.9 seconds worth)\n"
+		"  --iface-burst        Packets that may be sent on an "
+		"interface at\n"
+		"                       once (default=1.9 seconds worth)\n"
+		"  --src-table          Source limiter table: direct (hashed "
+		"buckets),\n"
+		"                       exact (keyed, with eviction), "
+		"sketch\n"
+		"                       (count-min sketch), gcra (8 byte "
+		"buckets)\n"
+		"                       or gcra-coarse (4 byte buckets)\n"
+		"  --src-size           Number of source limiter buckets, "
+		"per row\n"
+		"                       for sketch (default=%u)\n"
+		"  --src-max-size       Grow an exact source table, while "
+		"running,\n"
+		"                       up to this many buckets. SIGUSR1 "
+		"grows it\n"
+		"                       regardless\n"
+		"  --src-depth          Number of rows of sketch table "
+		"(default=%u)\n"
+		"  --src-prefix4        Limit IPv4 sources by prefix of given "
+		"length\n"
+		"  --src-prefix6        Limit IPv6 sources by prefix of given "
+		"length\n"
+		"  --prefix-rate        Pps limit from single source prefix. "
+		"With\n"
+		"                       this, sources are limited both by "
+		"address\n"
+		"                       and by prefix\n"
+		"  --two-level          Limit sources as routers, with an "
+		"aggregate\n"
+		"                       budget, and the clients they send "
+		"PTBs\n"
+		"                       for, each with its own budget. "
+		"Replaces\n"
+		"                       --src-rate, --src-burst is the "
+		"router's\n"
+		"                       and clients get as many seconds "
+		"worth\n"
+		"  --router-rate        Pps limit from single router in "
+		"two-level\n"
+		"                       mode (default=%.1f pps)\n"
+		"  --client-rate        Pps limit for single client in "
+		"two-level\n"
+		"                       mode (default=%.1f pps)\n"
+		"  --iface-adapt        Adapt interface rate to drops and "
+		"ENOBUFS,\n"
+		"                       within FLOOR:CEILING pps\n"
+		"  --adapt-export       Write the adapted rate to given file\n"
+		"  --topk-export        Write the most ratelimited sources "
+		"and\n"
+		"                       clients to given file every %is\n"
+		"  --fair-queue         Share the interface rate equally "
+		"between\n"
+		"                       active sources, queueing PTBs per "
+		"source\n"
+		"                       or per prefix, as given\n"
+		"  --shadow             Also evaluate limits at other rates, "
+		"as\n"
+		"                       SRC_RATE:IFACE_RATE, without "
+		"affecting\n"
+		"                       forwarding. May be given up to %i "
+		"times\n"
+		"  --shadow-export      Write what the shadow profiles would "
+		"have\n"
+		"                       done to given file every %is\n"
+		"  --limit              Add a limiter keyed on packet fields, "
+		"as\n"
+		"                       FIELDS:RATE[:BURST]. FIELDS is a "
+		"comma\n"
+		"                       separated list of src, dst, inner-src,"
+		"\n"
+		"                       proto, sport, dport, 5tuple, vlan and "
+		"mtu.\n"
+		"                       May be given up to %i times\n"
 		"  --verbose            Print forwarded packets on screen\n"
 		"  --strict             Forward only packets with MTU that\n"
 		"                       makes sense, between 576 and 1499\n"
@@ -55,13 +174,35 @@ static void usage()
 		"                       containing L4 source port on this "
 		"list\n"
 		"                       (comma separated)\n"
+		"  --bundle             Pack PTBs accepted within given "
+		"number\n"
+		"                       of milliseconds into one frame\n"
+		"  --bundle-recv        Receive PTB bundles on --iface and\n"
+		"                       inject them on given local interface\n"
+		"  --clock              Clock for rate limits: cached, "
+		"monotonic,\n"
+		"                       coarse or tsc (default=cached)\n"
+		"  --hash               Hash picking limiter buckets: "
+		"siphash24,\n"
+		"                       siphash13, halfsiphash or multshift\n"
+		"                       (default=siphash24)\n"
+		"  --state-dir          Keep limiter state in files in "
+		"given\n"
+		"                       directory, reused after a restart\n"
+		"  --shm                Share limiter state with other "
+		"pmtud\n"
+		"                       processes using the same name\n"
 		"  --help               Print this message\n"
 		"\n"
 		"Example:\n"
 		"\n"
 		"    pmtud --iface=eth2 --src-rate=%.1f --iface-rate=%.1f\n"
 		"\n",
-		SRC_RATE_PPS, IFACE_RATE_PPS, SRC_RATE_PPS, IFACE_RATE_PPS);
+		SRC_RATE_PPS, IFACE_RATE_PPS, VLAN_RATES_MAX, SRC_TABLE_SIZE,
+		SRC_SKETCH_DEPTH,
+		ROUTER_RATE_PPS, CLIENT_RATE_PPS, TOPK_INTERVAL_MS / 1000,
+		SHADOWS_MAX, SHADOW_INTERVAL_MS / 1000,
+		LIMITERS_MAX, SRC_RATE_PPS, IFACE_RATE_PPS);
 	exit(-1);
 }
 
@@ -71,6 +212,34 @@ static void usage()
 	" (icmp6 and ip6[40+0] == 2 and ip6[40+1] == 0)) and"                  \
 	"(ether dst not ff:ff:ff:ff:ff:ff)"
 
+/* Buffers for frames waiting for deferred transmission */
+#define PKTPOOL_SIZE 1024
+
+/* Fair queueing in front of the interface limiter. Sources hash into
+ * this many queues, and PTBs waiting longer than the delay are dropped
+ * as the sender has likely given up. */
+#define FAIR_FLOWS 256
+#define FAIR_MAX_DELAY_MS 500
+#define FAIR_TICK_MS 10
+/* With a byte rate on the interface, queues are served in bytes */
+#define FAIR_QUANTUM_BYTES 1514
+/* Default prefixes for --fair-queue=prefix */
+#define FAIR_PREFIX4 24
+#define FAIR_PREFIX6 48
+
+/* Exact source tables grow, up to --src-max-size, when this full and
+ * still evicting live entries. Slots moved per loop iteration. */
+#define SRC_GROW_OCCUPANCY_PCT 75
+#define RESIZE_STEP 1024
+#define RESIZE_TICK_MS 1
+
+/* How often the adaptive interface rate is updated */
+#define ADAPT_INTERVAL_MS 1000
+
+#define BUNDLE_SNAPLEN 65535
+#define BUNDLE_BPF_FILTER                                                      \
+	"ether proto 0x88b5 or (vlan and ether proto 0x88b5)"
+
 static int on_signal(struct uevent *uevent, int sfd, int mask, void *userdata)
 {
 	volatile int *done = userdata;
@@ -85,19 +254,232 @@ static int on_signal(struct uevent *uevent, int sfd, int mask, void *userdata)
 	return 0;
 }
 
+/* SIGUSR1, grow the source table now */
+static int on_grow(struct uevent *uevent, int sfd, int mask, void *userdata)
+{
+	int *grow = userdata;
+	int buf[512];
+	int r = read(sfd, buf, sizeof(buf));
+	if (r < 0) {
+		PFATAL("read()");
+	}
+
+	*grow = 1;
+	return 0;
+}
+
+struct limiter
+{
+	unsigned fields;
+	struct hashlimit *hl;
+	char name[64];
+	char reason[80];
+};
+
+/* Source and interface limits at other rates, charged with the same
+ * packets as the live ones but never affecting forwarding */
+struct shadow
+{
+	struct hashlimit *sources;
+	struct hashlimit *ifaces;
+	char name[64];
+	uint64_t accepted;
+	uint64_t src_refused;
+	uint64_t iface_refused;
+};
+
+struct vlan_limit
+{
+	unsigned vlan;
+	struct hashlimit *hl;
+};
+
 struct state
 {
 	pcap_t *pcap;
 	struct nflog *nflog;
 	int raw_sd;
+	int inject_sd;
+	struct pktpool *pool;
+	struct bundle *bundle;
 	struct hashlimit *sources;
+	struct hashlimit *prefixes;
 	struct hashlimit *ifaces;
+	/* Byte rate limits, charged with the frame length */
+	struct hashlimit *src_bytes;
+	struct hashlimit *iface_bytes;
+	/* Interface limits by egress VLAN, --iface-vlan. Untagged
+	 * frames count as VLAN 0. */
+	int iface_vlan;
+	struct vlan_limit vlan_limits[VLAN_RATES_MAX];
+	int vlan_limits_len;
+	uint64_t *vlan_sent;
+	uint64_t *vlan_refused;
+	/* Two-level mode only */
+	struct hashlimit *clients;
+	uint64_t router_refused;
+	uint64_t client_refused;
+	uint64_t client_unknown;
+	struct limiter limiters[LIMITERS_MAX];
+	int limiters_len;
+	/* Adaptive interface rate, the burst is kept in seconds */
+	struct adapt *adapt;
+	const char *adapt_export;
+	double iface_burst_secs;
+	uint64_t rx_enobufs;
+	uint64_t tx_enobufs;
+	/* Ratelimited sources and clients, --topk-export */
+	struct topk *top_sources;
+	struct topk *top_clients;
+	const char *topk_export;
+	/* Fair queueing, flows are sources or their prefixes */
+	struct drr *drr;
+	int fair_prefix4;
+	int fair_prefix6;
+	/* Shadow profiles, with the live decisions to compare with and
+	 * the time spent on the shadows */
+	struct shadow shadows[SHADOWS_MAX];
+	int shadows_len;
+	const char *shadow_export;
+	uint64_t live_accepted;
+	uint64_t live_refused;
+	uint64_t shadow_ns;
+	/* Growing the source table, --src-max-size and SIGUSR1 */
+	unsigned src_max_size;
+	uint64_t src_forced_evictions;
+	int grow_requested;
+	int src_prefix4;
+	int src_prefix6;
 	int verbose;
 	int dry_run;
 	int strict;
 	uint64_t *ports_map;
 };
 
+/* Sends a frame right away, or adds it to the current bundle. buf, if
+ * given, holds a copy of the frame. */
+static void transmit(struct state *state, struct pktbuf *buf,
+		     const uint8_t *data, unsigned data_len,
+		     unsigned l3_offset)
+{
+	if (state->dry_run) {
+		return;
+	}
+
+	/* The capture buffer is gone once we return, deferred
+	 * transmissions need their own copy. */
+	int copied = 0;
+	if (state->bundle && buf == NULL) {
+		buf = pktbuf_copy(state->pool, data, data_len);
+		copied = 1;
+	}
+
+	if (state->bundle == NULL || buf == NULL ||
+	    bundle_add(state->bundle, buf, l3_offset) < 0) {
+		int r = send(state->raw_sd, data, data_len, 0);
+		/* ENOBUFS happens during IRQ storms okay to ignore */
+		if (r < 0 && errno != ENOBUFS) {
+			PFATAL("send()");
+		}
+		if (r < 0) {
+			state->tx_enobufs += 1;
+		}
+	}
+
+	if (copied && buf) {
+		pktbuf_put(state->pool, buf);
+	}
+}
+
+static unsigned frame_vlan(const uint8_t *p, unsigned l3_offset)
+{
+	if (l3_offset != 18) {
+		return 0;
+	}
+	return (((uint16_t)p[14] << 8) | p[15]) & 0x0fff;
+}
+
+/* Interface buckets for a frame sent on vlan, packets and bytes.
+ * Returns the number of buckets. */
+static int iface_buckets(struct state *state, unsigned vlan,
+			 unsigned data_len, struct hl_bucket *b)
+{
+	int b_len = 0, i;
+	if (state->iface_vlan == 0) {
+		vlan = 0;
+	}
+	for (i = 0; i < state->vlan_limits_len; i++) {
+		if (state->vlan_limits[i].vlan == vlan) {
+			break;
+		}
+	}
+	if (i < state->vlan_limits_len) {
+		hashlimit_bucket(state->vlan_limits[i].hl, 0, &b[b_len++]);
+	} else {
+		hashlimit_bucket(state->ifaces, vlan, &b[b_len++]);
+	}
+	if (state->iface_bytes) {
+		hashlimit_bucket(state->iface_bytes, vlan, &b[b_len]);
+		b[b_len++].cost = data_len;
+	}
+	return b_len;
+}
+
+/* Queued PTBs go out only as the interface limiter allows */
+static int fair_send(struct pktbuf *buf, unsigned l3_offset, void *userdata)
+{
+	struct state *state = userdata;
+	unsigned vlan = frame_vlan(buf->data, l3_offset);
+	struct hl_bucket b[2];
+	int b_len = iface_buckets(state, vlan, buf->len, b);
+	if (hashlimit_consume(b, b_len) != b_len) {
+		/* Other VLANs may still have budget */
+		return state->iface_vlan ? -1 : 0;
+	}
+	if (state->iface_vlan) {
+		state->vlan_sent[vlan] += 1;
+	}
+	transmit(state, buf, buf->data, buf->len, l3_offset);
+	return 1;
+}
+
+/* A queued PTB never got interface budget, refused on its VLAN only
+ * now, however many times it was retried */
+static void fair_drop(struct pktbuf *buf, unsigned l3_offset, void *userdata)
+{
+	struct state *state = userdata;
+	if (state->iface_vlan) {
+		state->vlan_refused[frame_vlan(buf->data, l3_offset)] += 1;
+	}
+}
+
+static void run_shadows(struct state *state, const uint8_t *key, int key_len)
+{
+	struct timespec t0, t1;
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+
+	int i;
+	for (i = 0; i < state->shadows_len; i++) {
+		struct shadow *sh = &state->shadows[i];
+		struct hl_bucket b[2];
+		hashlimit_bucket_hash(sh->sources, key, key_len, &b[0]);
+		hashlimit_bucket(sh->ifaces, 0, &b[1]);
+		switch (hashlimit_consume(b, 2)) {
+		case 0:
+			sh->src_refused += 1;
+			break;
+		case 1:
+			sh->iface_refused += 1;
+			break;
+		default:
+			sh->accepted += 1;
+		}
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	state->shadow_ns += TIMESPEC_NSEC(&t1) - TIMESPEC_NSEC(&t0);
+}
+
 static int handle_packet(const uint8_t *p, unsigned data_len, void *userdata)
 {
 	struct state *state = userdata;
@@ -248,23 +630,151 @@ static int handle_packet(const uint8_t *p, unsigned data_len, void *userdata)
 		pp[6 + i] = dst_mac[i];
 	}
 
-	/* Check if the limits will be reached */
-	int limit_src = hashlimit_check_hash(state->sources, hash, hash_len);
-	int limit_iface = hashlimit_check(state->ifaces, 0);
+	/* Source key is the address, or its prefix if there is no
+	 * separate prefix limit. */
+	const uint8_t *src_key = hash;
+	uint8_t prefix[16];
+	int prefix_len =
+		hash_len == 4 ? state->src_prefix4 : state->src_prefix6;
+	if (state->prefixes || prefix_len < hash_len * 8) {
+		ip_prefix(prefix, hash, hash_len, prefix_len);
+		if (state->prefixes == NULL) {
+			src_key = prefix;
+		}
+	}
 
-	if (limit_src == 0) {
-		reason = "Ratelimited on source IP";
-		goto reject;
+	/* Charge all the limits together, only if none of them is
+	 * reached. */
+	struct hl_bucket buckets[6 + LIMITERS_MAX];
+	const char *reasons[6 + LIMITERS_MAX];
+	int buckets_len = 0;
+
+	struct pkt_fields fields;
+	if (state->clients || state->limiters_len || state->top_sources) {
+		limitkey_fields(&fields, p, data_len, l3_offset, icmp_offset);
+		fields.mtu = mtu_of_next_hop;
+	}
+
+	/* A client over its budget mustn't use up the router's */
+	int client_bucket = -1;
+	if (state->clients && fields.inner_dst) {
+		hashlimit_bucket_hash(state->clients, fields.inner_dst,
+				      fields.inner_len, &buckets[buckets_len]);
+		client_bucket = buckets_len;
+		reasons[buckets_len++] = "Ratelimited on client";
+	} else if (state->clients) {
+		state->client_unknown += 1;
 	}
-	if (limit_iface == 0) {
-		reason = "Ratelimited on outgoing interface";
+
+	int router_bucket = buckets_len;
+	hashlimit_bucket_hash(state->sources, src_key, hash_len,
+			      &buckets[buckets_len]);
+	reasons[buckets_len++] = state->clients ? "Ratelimited on router"
+						: "Ratelimited on source IP";
+
+	if (state->prefixes) {
+		hashlimit_bucket_hash(state->prefixes, prefix, hash_len,
+				      &buckets[buckets_len]);
+		reasons[buckets_len++] = "Ratelimited on source prefix";
+	}
+
+	if (state->src_bytes) {
+		hashlimit_bucket_hash(state->src_bytes, src_key, hash_len,
+				      &buckets[buckets_len]);
+		buckets[buckets_len].cost = data_len;
+		reasons[buckets_len++] = "Ratelimited on source bytes";
+	}
+
+	for (i = 0; i < state->limiters_len; i++) {
+		struct limiter *l = &state->limiters[i];
+		uint8_t key[LIMITKEY_MAX];
+		int key_len = limitkey_compose(l->fields, &fields, key);
+		hashlimit_bucket_hash(l->hl, key, key_len,
+				      &buckets[buckets_len]);
+		reasons[buckets_len++] = l->reason;
+	}
+
+	/* With fair queueing the interface is charged on dequeue */
+	unsigned vlan = frame_vlan(p, l3_offset);
+	int iface_bucket = buckets_len;
+	if (state->drr == NULL) {
+		int n = iface_buckets(state, vlan, data_len,
+				      &buckets[buckets_len]);
+		reasons[buckets_len++] = "Ratelimited on outgoing interface";
+		if (n == 2) {
+			reasons[buckets_len++] =
+				"Ratelimited on outgoing interface bytes";
+		}
+	}
+
+	/* Take a queue slot and a buffer first, a PTB that can't be queued
+	 * mustn't use up its source's budget */
+	const uint8_t *flow = src_key;
+	uint8_t flow_prefix[16];
+	struct pktbuf *buf = NULL;
+	if (state->drr) {
+		int fair_prefix = hash_len == 4 ? state->fair_prefix4
+						: state->fair_prefix6;
+		if (fair_prefix) {
+			ip_prefix(flow_prefix, hash, hash_len, fair_prefix);
+			flow = flow_prefix;
+		}
+		if (drr_admit(state->drr, flow, hash_len) == 0) {
+			buf = pktbuf_copy(state->pool, pp, data_len);
+		}
+		if (buf == NULL) {
+			if (state->iface_vlan) {
+				state->vlan_refused[vlan] += 1;
+			}
+			reason = "Interface queue full";
+			goto reject;
+		}
+	}
+
+	int refused = hashlimit_consume(buckets, buckets_len);
+	if (state->shadows_len) {
+		run_shadows(state, src_key, hash_len);
+		state->live_accepted += refused == buckets_len;
+		state->live_refused += refused != buckets_len;
+	}
+	if (state->iface_vlan && refused >= iface_bucket &&
+	    refused != buckets_len) {
+		state->vlan_refused[vlan] += 1;
+	}
+	if (state->iface_vlan && refused == buckets_len &&
+	    state->drr == NULL) {
+		state->vlan_sent[vlan] += 1;
+	}
+	if (refused == client_bucket) {
+		state->client_refused += 1;
+	}
+	if (refused == router_bucket && state->clients) {
+		state->router_refused += 1;
+	}
+	if (refused != buckets_len && state->top_sources) {
+		topk_add(state->top_sources, hash, hash_len);
+		if (fields.inner_dst) {
+			topk_add(state->top_clients, fields.inner_dst,
+				 fields.inner_len);
+		}
+	}
+	if (refused != buckets_len) {
+		if (buf) {
+			pktbuf_put(state->pool, buf);
+		}
+		reason = reasons[refused];
 		goto reject;
 	}
 
-	hashlimit_subtract_hash(state->sources, hash, hash_len);
-	hashlimit_subtract(state->ifaces, 0);
+	if (buf) {
+		/* Can't fail, the slot was checked above */
+		drr_enqueue(state->drr, flow, hash_len, buf, l3_offset,
+			    state->iface_bytes ? data_len : 1,
+			    TIMESPEC_NSEC(&uevent_now));
+		pktbuf_put(state->pool, buf);
+	}
 
-	reason = "transmitting";
+	reason = state->drr ? "queued" : "transmitting";
 	if (state->verbose > 2) {
 		printf("%s %s mtu=%i sport=%i  %s\n",
 		       ip_to_string(hash, hash_len), reason, mtu_of_next_hop,
@@ -274,12 +784,11 @@ static int handle_packet(const uint8_t *p, unsigned data_len, void *userdata)
 		       reason, mtu_of_next_hop, l4_sport);
 	}
 
-	if (state->dry_run == 0) {
-		int r = send(state->raw_sd, pp, data_len, 0);
-		/* ENOBUFS happens during IRQ storms okay to ignore */
-		if (r < 0 && errno != ENOBUFS) {
-			PFATAL("send()");
-		}
+	if (state->drr) {
+		drr_run(state->drr, TIMESPEC_NSEC(&uevent_now), fair_send,
+			fair_drop, state);
+	} else {
+		transmit(state, NULL, pp, data_len, l3_offset);
 	}
 	return 1;
 
@@ -296,10 +805,41 @@ reject:
 	return -1;
 }
 
+static int handle_record(int type, const uint8_t *l3, unsigned l3_len,
+			 void *userdata)
+{
+	struct state *state = userdata;
+
+	if (state->verbose > 2) {
+		printf("bundled IPv%i len=%u  %s\n", type, l3_len,
+		       to_hex(l3, l3_len));
+	} else if (state->verbose) {
+		printf("bundled IPv%i len=%u\n", type, l3_len);
+	}
+
+	if (state->dry_run == 0) {
+		return bundle_inject(state->inject_sd, type, l3, l3_len);
+	}
+	return 0;
+}
+
+static int handle_bundle(const uint8_t *p, unsigned data_len, void *userdata)
+{
+	struct state *state = userdata;
+
+	int r = bundle_unpack(p, data_len, handle_record, state);
+	if (r < 0 && state->verbose > 1) {
+		printf("Malformed bundle len=%u\n", data_len);
+	}
+	return r;
+}
+
 static int handle_pcap(struct uevent *uevent, int sfd, int mask, void *userdata)
 {
 	struct state *state = userdata;
 
+	hashlimit_clock_cache(TIMESPEC_NSEC(&uevent_now));
+
 	while (1) {
 		struct pcap_pkthdr *hdr;
 		const uint8_t *data;
@@ -309,7 +849,11 @@ static int handle_pcap(struct uevent *uevent, int sfd, int mask, void *userdata)
 		switch (r) {
 		case 1:
 			if (hdr->len == hdr->caplen) {
-				handle_packet(data, hdr->caplen, state);
+				if (state->inject_sd >= 0) {
+					handle_bundle(data, hdr->caplen, state);
+				} else {
+					handle_packet(data, hdr->caplen, state);
+				}
 			} else {
 				/* Partial caputre */
 			}
@@ -334,6 +878,8 @@ static int handle_nflog(struct uevent *uevent, int n_fd, int mask,
 {
 	struct state *state = userdata;
 
+	hashlimit_clock_cache(TIMESPEC_NSEC(&uevent_now));
+
 	while (1) {
 		struct nflog *n = state->nflog;
 		uint8_t buf[4096] __attribute__((aligned));
@@ -344,6 +890,7 @@ static int handle_nflog(struct uevent *uevent, int n_fd, int mask,
 				break;
 			} else if (errno == ENOBUFS) {
 				/* Running behind, ignore */
+				state->rx_enobufs += 1;
 			} else {
 				PFATAL("recv()");
 			}
@@ -357,6 +904,207 @@ static int handle_nflog(struct uevent *uevent, int n_fd, int mask,
 	return 0;
 }
 
+static void adapt_iface_rate(struct state *state)
+{
+	uint64_t drops = state->rx_enobufs;
+	if (state->pcap) {
+		struct pcap_stat stats = {0, 0, 0};
+		if (pcap_stats(state->pcap, &stats) == 0) {
+			drops += stats.ps_drop + stats.ps_ifdrop;
+		}
+	}
+
+	uint64_t enobufs = state->tx_enobufs;
+	if (state->bundle) {
+		uint64_t bundles, records, bundle_enobufs;
+		bundle_stats(state->bundle, &bundles, &records,
+			     &bundle_enobufs);
+		enobufs += bundle_enobufs;
+	}
+
+	if (adapt_sample(state->adapt, drops, enobufs)) {
+		double rate = adapt_rate(state->adapt);
+		hashlimit_set_rate(state->ifaces, rate,
+				   rate * state->iface_burst_secs);
+		if (state->verbose) {
+			fprintf(stderr, "[*] #%i iface rate %.1f pps\n",
+				getpid(), rate);
+		}
+	}
+
+	if (state->adapt_export &&
+	    adapt_export(state->adapt, state->adapt_export) < 0) {
+		ERRORF("[ ] Failed to export rate to %s: %s\n",
+		       state->adapt_export, strerror(errno));
+	}
+}
+
+static void grow_sources(struct state *state)
+{
+	struct hl_stats st;
+	hashlimit_stats(state->sources, &st);
+	int forced = st.forced_evictions != state->src_forced_evictions;
+	state->src_forced_evictions = st.forced_evictions;
+
+	/* Full is not enough, entries of gone sources are never removed
+	 * but are replaced for free. */
+	int requested = state->grow_requested;
+	state->grow_requested = 0;
+	unsigned size = st.size * 2 + 1;
+	int full = st.occupancy * 100 >= st.size * SRC_GROW_OCCUPANCY_PCT;
+	/* The new table fills up while entries move over, wait for the
+	 * move to finish */
+	if (!requested && (st.resizing || !forced || !full ||
+			   st.size >= state->src_max_size)) {
+		return;
+	}
+	/* The last step may be less than double */
+	if (!requested && size > state->src_max_size) {
+		size = state->src_max_size;
+	}
+
+	struct hashlimit *hl = hashlimit_resize(state->sources, size);
+	if (hl == NULL) {
+		ERRORF("[ ] Can't grow source table: %s\n",
+		       errno == EBUSY ? "already growing"
+				      : "not a private exact table");
+		return;
+	}
+	state->sources = hl;
+	fprintf(stderr, "[*] #%i Growing source table to %u buckets\n",
+		getpid(), size);
+}
+
+static void print_shadows(struct state *state, FILE *f, const char *prefix)
+{
+	uint64_t packets = state->live_accepted + state->live_refused;
+	fprintf(f, "%slive accepted=%lu refused=%lu\n", prefix,
+		state->live_accepted, state->live_refused);
+	int i;
+	for (i = 0; i < state->shadows_len; i++) {
+		struct shadow *sh = &state->shadows[i];
+		fprintf(f,
+			"%sshadow %s accepted=%lu src_refused=%lu "
+			"iface_refused=%lu\n",
+			prefix, sh->name, sh->accepted, sh->src_refused,
+			sh->iface_refused);
+	}
+	fprintf(f, "%sshadow cost=%.1f ns/packet\n", prefix,
+		packets ? (double)state->shadow_ns / packets : 0.0);
+}
+
+static void export_shadows(struct state *state)
+{
+	char tmp[PATH_MAX];
+	snprintf(tmp, sizeof(tmp), "%s.tmp", state->shadow_export);
+
+	FILE *f = fopen(tmp, "w");
+	if (f == NULL) {
+		ERRORF("[ ] Failed to export shadow profiles to %s: %s\n",
+		       tmp, strerror(errno));
+		return;
+	}
+	print_shadows(state, f, "");
+	fclose(f);
+	if (rename(tmp, state->shadow_export) < 0) {
+		ERRORF("[ ] rename(%s): %s\n", tmp, strerror(errno));
+	}
+}
+
+static void export_topk(struct state *state)
+{
+	char tmp[PATH_MAX];
+	snprintf(tmp, sizeof(tmp), "%s.tmp", state->topk_export);
+
+	FILE *f = fopen(tmp, "w");
+	if (f == NULL) {
+		ERRORF("[ ] Failed to export top ratelimited to %s: %s\n",
+		       tmp, strerror(errno));
+		return;
+	}
+	fprintf(f, "interval=%i\n", TOPK_INTERVAL_MS / 1000);
+	topk_print(state->top_sources, f, "src", TOPK_SIZE);
+	topk_print(state->top_clients, f, "dst", TOPK_SIZE);
+	fclose(f);
+	if (rename(tmp, state->topk_export) < 0) {
+		ERRORF("[ ] rename(%s): %s\n", tmp, strerror(errno));
+	}
+
+	/* Every export covers one interval */
+	topk_reset(state->top_sources);
+	topk_reset(state->top_clients);
+}
+
+static struct hashlimit *alloc_table(const char *table, unsigned size,
+				     unsigned depth, double rate,
+				     double burst)
+{
+	if (strcmp(table, "exact") == 0) {
+		return hashlimit_alloc_exact(size, rate, burst);
+	}
+	if (strcmp(table, "sketch") == 0) {
+		return hashlimit_alloc_sketch(size, depth, rate, burst);
+	}
+	if (strcmp(table, "gcra") == 0) {
+		return hashlimit_alloc_gcra(size, rate, burst);
+	}
+	if (strcmp(table, "gcra-coarse") == 0) {
+		struct hashlimit *hl =
+			hashlimit_alloc_gcra_coarse(size, rate, burst);
+		if (hl == NULL) {
+			FATAL("Burst of %.0f at rate %.2f too long for a "
+			      "gcra-coarse table",
+			      burst, rate);
+		}
+		return hl;
+	}
+	if (strcmp(table, "atomic") == 0) {
+		return hashlimit_alloc_atomic(size, rate, burst);
+	}
+	return hashlimit_alloc(size, rate, burst);
+}
+
+/* Tables live in files under state_dir, when given, so that a
+ * restarted pmtud continues where the previous one stopped. Or in
+ * shared memory segments prefixed with shm, shared with other pmtud
+ * processes. */
+static struct hashlimit *map_table(struct hashlimit *hl,
+				   const char *state_dir, const char *shm,
+				   const char *name)
+{
+	char path[PATH_MAX];
+	int reused;
+	if (state_dir) {
+		snprintf(path, sizeof(path), "%s/%s", state_dir, name);
+		hl = hashlimit_map(hl, path, &reused);
+	} else if (shm) {
+		snprintf(path, sizeof(path), "/pmtud.%s.%s", shm, name);
+		hl = hashlimit_map_shm(hl, path, &reused);
+	} else {
+		return hl;
+	}
+
+	if (hl == NULL && errno == EBUSY) {
+		FATAL("%s is used by pmtud with different limits", path);
+	}
+	if (hl == NULL) {
+		PFATAL("hashlimit_map(%s)", path);
+	}
+	fprintf(stderr, "[*] #%i %s state %s\n", getpid(),
+		reused ? "Reusing" : "Initialized", path);
+	return hl;
+}
+
+static void print_table_stats(const char *name, struct hashlimit *hl)
+{
+	struct hl_stats hl_stats;
+	hashlimit_stats(hl, &hl_stats);
+	fprintf(stderr,
+		"[*] #%i %s occupancy=%u/%u evictions=%lu forced=%lu\n",
+		getpid(), name, hl_stats.occupancy, hl_stats.size,
+		hl_stats.evictions, hl_stats.forced_evictions);
+}
+
 int main(int argc, char *argv[])
 {
 	static struct option long_options[] = {
@@ -370,6 +1118,35 @@ int main(int argc, char *argv[])
 		{"help", no_argument, 0, 'h'},
 		{"ports", required_argument, 0, 'p'},
 		{"strict", no_argument, 0, 't'},
+		{"bundle", required_argument, 0, 'b'},
+		{"bundle-recv", required_argument, 0, 'B'},
+		{"clock", required_argument, 0, 'k'},
+		{"hash", required_argument, 0, 'z'},
+		{"src-table", required_argument, 0, 'T'},
+		{"src-size", required_argument, 0, 'S'},
+		{"src-depth", required_argument, 0, 'D'},
+		{"src-prefix4", required_argument, 0, '4'},
+		{"src-prefix6", required_argument, 0, '6'},
+		{"prefix-rate", required_argument, 0, 'P'},
+		{"state-dir", required_argument, 0, 'm'},
+		{"shm", required_argument, 0, 'H'},
+		{"src-burst", required_argument, 0, 'e'},
+		{"iface-burst", required_argument, 0, 'E'},
+		{"limit", required_argument, 0, 'l'},
+		{"two-level", no_argument, 0, 'L'},
+		{"router-rate", required_argument, 0, 'R'},
+		{"client-rate", required_argument, 0, 'C'},
+		{"iface-adapt", required_argument, 0, 'a'},
+		{"adapt-export", required_argument, 0, 'x'},
+		{"topk-export", required_argument, 0, 'K'},
+		{"fair-queue", required_argument, 0, 'f'},
+		{"src-byte-rate", required_argument, 0, 'y'},
+		{"iface-byte-rate", required_argument, 0, 'Y'},
+		{"iface-vlan", no_argument, 0, 'V'},
+		{"vlan-rate", required_argument, 0, 'w'},
+		{"src-max-size", required_argument, 0, 'M'},
+		{"shadow", required_argument, 0, 'u'},
+		{"shadow-export", required_argument, 0, 'U'},
 		{NULL, 0, 0, 0}};
 
 	const char *optstring = optstring_from_long_options(long_options);
@@ -377,12 +1154,48 @@ int main(int argc, char *argv[])
 	int nflog_group = -1;
 
 	double src_rate = SRC_RATE_PPS;
+	int src_rate_set = 0;
 	double iface_rate = IFACE_RATE_PPS;
+	/* Default to 1.9 seconds worth of packets */
+	double src_burst = 0.0;
+	double iface_burst = 0.0;
+	double src_byte_rate = 0.0;
+	double iface_byte_rate = 0.0;
 	int verbose = 0;
 	int dry_run = 0;
 	int taskset_cpu = -1;
 	uint64_t *ports_map = NULL;
 	int strict = 0;
+	int bundle_ms = 0;
+	const char *bundle_recv = NULL;
+	enum hl_clock clock_source = HL_CLOCK_CACHED;
+	const char *clock_name = "cached";
+	enum hl_hash hash = HL_HASH_SIPHASH24;
+	const char *src_table = "direct";
+	int src_size = SRC_TABLE_SIZE;
+	int src_depth = SRC_SKETCH_DEPTH;
+	int src_max_size = 0;
+	int src_prefix4 = 32;
+	int src_prefix6 = 128;
+	double prefix_rate = 0.0;
+	int two_level = 0;
+	double router_rate = ROUTER_RATE_PPS;
+	double client_rate = CLIENT_RATE_PPS;
+	double adapt_floor = 0.0;
+	double adapt_ceiling = 0.0;
+	const char *adapt_export = NULL;
+	const char *topk_export = NULL;
+	const char *fair_queue = NULL;
+	const char *state_dir = NULL;
+	const char *shm = NULL;
+	const char *limits[LIMITERS_MAX];
+	int limits_len = 0;
+	int iface_vlan = 0;
+	const char *shadows[SHADOWS_MAX];
+	int shadows_len = 0;
+	const char *shadow_export = NULL;
+	const char *vlan_rates[VLAN_RATES_MAX];
+	int vlan_rates_len = 0;
 
 	optind = 1;
 	while (1) {
@@ -423,6 +1236,7 @@ int main(int argc, char *argv[])
 			if (src_rate <= 0.0) {
 				FATAL("Rates must be greater than zero");
 			}
+			src_rate_set = 1;
 			break;
 
 		case 't':
@@ -435,6 +1249,122 @@ int main(int argc, char *argv[])
 			}
 			break;
 
+		case 'e':
+			src_burst = atof(optarg);
+			if (src_burst < 1.0) {
+				FATAL("Burst must be at least one packet");
+			}
+			break;
+
+		case 'E':
+			iface_burst = atof(optarg);
+			if (iface_burst < 1.0) {
+				FATAL("Burst must be at least one packet");
+			}
+			break;
+
+		case 'y':
+			src_byte_rate = atof(optarg);
+			if (src_byte_rate <= 0.0) {
+				FATAL("Rates must be greater than zero");
+			}
+			if (src_byte_rate > BYTE_RATE_MAX) {
+				FATAL("Byte rates must be at most %.0f",
+				      BYTE_RATE_MAX);
+			}
+			break;
+
+		case 'Y':
+			iface_byte_rate = atof(optarg);
+			if (iface_byte_rate <= 0.0) {
+				FATAL("Rates must be greater than zero");
+			}
+			if (iface_byte_rate > BYTE_RATE_MAX) {
+				FATAL("Byte rates must be at most %.0f",
+				      BYTE_RATE_MAX);
+			}
+			break;
+
+		case 'L':
+			two_level = 1;
+			break;
+
+		case 'V':
+			iface_vlan = 1;
+			break;
+
+		case 'u':
+			if (shadows_len == SHADOWS_MAX) {
+				FATAL("At most %i --shadow options are "
+				      "supported",
+				      SHADOWS_MAX);
+			}
+			shadows[shadows_len++] = optarg;
+			break;
+
+		case 'U':
+			shadow_export = optarg;
+			break;
+
+		case 'w':
+			if (vlan_rates_len == VLAN_RATES_MAX) {
+				FATAL("At most %i --vlan-rate options are "
+				      "supported",
+				      VLAN_RATES_MAX);
+			}
+			vlan_rates[vlan_rates_len++] = optarg;
+			iface_vlan = 1;
+			break;
+
+		case 'R':
+			router_rate = atof(optarg);
+			if (router_rate <= 0.0) {
+				FATAL("Rates must be greater than zero");
+			}
+			break;
+
+		case 'C':
+			client_rate = atof(optarg);
+			if (client_rate <= 0.0) {
+				FATAL("Rates must be greater than zero");
+			}
+			break;
+
+		case 'a':
+			if (sscanf(optarg, "%lf:%lf", &adapt_floor,
+				   &adapt_ceiling) != 2 ||
+			    adapt_floor <= 0.0 || adapt_ceiling < adapt_floor) {
+				FATAL("Adaptive rate must be FLOOR:CEILING, "
+				      "with 0 < FLOOR <= CEILING");
+			}
+			break;
+
+		case 'x':
+			adapt_export = optarg;
+			break;
+
+		case 'K':
+			topk_export = optarg;
+			break;
+
+		case 'f':
+			if (strcmp(optarg, "source") != 0 &&
+			    strcmp(optarg, "prefix") != 0) {
+				FATAL("Fair queueing must be by source or "
+				      "prefix");
+			}
+			fair_queue = optarg;
+			break;
+
+		case 'l':
+			if (limits_len == LIMITERS_MAX) {
+				FATAL("At most %i --limit options are "
+				      "supported",
+				      LIMITERS_MAX);
+			}
+			limits[limits_len++] = optarg;
+			break;
+
 		case 'p': {
 			if (ports_map == NULL) {
 				ports_map = bitmap_alloc(65536);
@@ -458,6 +1388,101 @@ int main(int argc, char *argv[])
 			break;
 		}
 
+		case 'b':
+			bundle_ms = atoi(optarg);
+			if (bundle_ms <= 0) {
+				FATAL("Bundle window must be greater than "
+				      "zero");
+			}
+			break;
+
+		case 'B':
+			bundle_recv = optarg;
+			break;
+
+		case 'k':
+			if (hashlimit_clock_parse(optarg, &clock_source) < 0) {
+				FATAL("Unknown clock %s", str_quote(optarg));
+			}
+			clock_name = optarg;
+			break;
+
+		case 'z':
+			if (hashlimit_hash_parse(optarg, &hash) < 0) {
+				FATAL("Unknown hash %s", str_quote(optarg));
+			}
+			break;
+
+		case 'T':
+			if (strcmp(optarg, "direct") != 0 &&
+			    strcmp(optarg, "exact") != 0 &&
+			    strcmp(optarg, "sketch") != 0 &&
+			    strcmp(optarg, "gcra") != 0 &&
+			    strcmp(optarg, "gcra-coarse") != 0) {
+				FATAL("Unknown source table %s",
+				      str_quote(optarg));
+			}
+			src_table = optarg;
+			break;
+
+		case 'S':
+			src_size = atoi(optarg);
+			if (src_size <= 0) {
+				FATAL("Table size must be greater than zero");
+			}
+			break;
+
+		case 'M':
+			src_max_size = atoi(optarg);
+			if (src_max_size <= 0) {
+				FATAL("Table size must be greater than zero");
+			}
+			break;
+
+		case 'D':
+			src_depth = atoi(optarg);
+			if (src_depth < 1 || src_depth > HL_DEPTH_MAX) {
+				FATAL("Sketch depth must be within range "
+				      "1..%i",
+				      HL_DEPTH_MAX);
+			}
+			break;
+
+		case '4':
+			src_prefix4 = atoi(optarg);
+			if (src_prefix4 < 0 || src_prefix4 > 32) {
+				FATAL("IPv4 prefix must be within range "
+				      "0..32");
+			}
+			break;
+
+		case '6':
+			src_prefix6 = atoi(optarg);
+			if (src_prefix6 < 0 || src_prefix6 > 128) {
+				FATAL("IPv6 prefix must be within range "
+				      "0..128");
+			}
+			break;
+
+		case 'P':
+			prefix_rate = atof(optarg);
+			if (prefix_rate <= 0.0) {
+				FATAL("Rates must be greater than zero");
+			}
+			break;
+
+		case 'm':
+			state_dir = optarg;
+			break;
+
+		case 'H':
+			if (strlen(optarg) == 0 || strchr(optarg, '/')) {
+				FATAL("Invalid shared memory name %s",
+				      str_quote(optarg));
+			}
+			shm = optarg;
+			break;
+
 		case 'v':
 			verbose++;
 			break;
@@ -484,6 +1509,58 @@ int main(int argc, char *argv[])
 		FATAL("Specify interface with --iface option");
 	}
 
+	if (bundle_recv && (nflog_group != -1 || bundle_ms)) {
+		FATAL("--bundle-recv can't be used with --nflog or --bundle");
+	}
+
+	/* The source limiter becomes the per router aggregate */
+	if (two_level) {
+		if (src_rate_set) {
+			FATAL("--two-level uses --router-rate, not --src-rate");
+		}
+		src_rate = router_rate;
+	}
+
+	if (src_burst == 0.0) {
+		src_burst = src_rate * 1.9;
+	}
+	/* As many seconds worth as a router, at least one packet */
+	double client_burst = client_rate * src_burst / src_rate;
+	if (client_burst < 1.0) {
+		client_burst = 1.0;
+	}
+	if (iface_burst == 0.0) {
+		iface_burst = iface_rate * 1.9;
+	}
+
+	if (state_dir && shm) {
+		FATAL("--state-dir can't be used with --shm");
+	}
+	/* Every process would set the shared rate from its own drops */
+	if (adapt_floor > 0.0 && shm) {
+		FATAL("--iface-adapt can't be used with --shm");
+	}
+	/* Live counts are only kept while shadows run */
+	if (shadow_export && !shadows_len) {
+		FATAL("--shadow-export requires --shadow");
+	}
+
+	if (src_max_size && (strcmp(src_table, "exact") != 0 || state_dir ||
+			     shm)) {
+		FATAL("--src-max-size needs exact source table, not kept "
+		      "in --state-dir or --shm");
+	}
+
+	/* Tables shared between processes must be updated atomically */
+	const char *iface_table = "direct";
+	if (shm) {
+		if (strcmp(src_table, "direct") != 0) {
+			FATAL("--shm supports only direct source table");
+		}
+		src_table = "atomic";
+		iface_table = "atomic";
+	}
+
 	if (set_core_dump(1) < 0) {
 		ERRORF("[ ] Failed to enable core dumps, continuing anyway.\n");
 	}
@@ -495,21 +1572,193 @@ int main(int argc, char *argv[])
 		}
 	}
 
+	if (hashlimit_clock_source(clock_source) < 0) {
+		FATAL("Clock %s not supported on this platform",
+		      str_quote(clock_name));
+	}
+	hashlimit_hash_function(hash);
+
 	struct pcap_stat stats = {0, 0, 0};
 	struct state state;
 	memset(&state, 0, sizeof(struct state));
-	state.sources = hashlimit_alloc(8191, src_rate, src_rate * 1.9);
-	state.ifaces = hashlimit_alloc(32, iface_rate, iface_rate * 1.9);
+	state.sources = map_table(
+		alloc_table(src_table, src_size, src_depth, src_rate,
+			    src_burst),
+		state_dir, shm, "sources");
+	if (prefix_rate > 0.0) {
+		state.prefixes = map_table(
+			alloc_table(src_table, src_size, src_depth,
+				    prefix_rate, prefix_rate * 1.9),
+			state_dir, shm, "prefixes");
+	}
+	int i;
+	if (two_level) {
+		state.clients = map_table(
+			alloc_table(src_table, src_size, src_depth,
+				    client_rate, client_burst),
+			state_dir, shm, "clients");
+	}
+	for (i = 0; i < limits_len; i++) {
+		struct limiter *l = &state.limiters[i];
+		/* FIELDS:RATE[:BURST] */
+		const char **org_parts = parse_argv(limits[i], ':');
+		const char **parts = org_parts;
+		if (parts[0] == NULL || parts[1] == NULL ||
+		    (parts[2] && parts[3])) {
+			FATAL("Malformed limit %s", str_quote(limits[i]));
+		}
+		if (limitkey_parse(parts[0], &l->fields) < 0) {
+			FATAL("Unknown key fields %s", str_quote(parts[0]));
+		}
+		double rate = atof(parts[1]);
+		double burst = parts[2] ? atof(parts[2]) : rate * 1.9;
+		if (rate <= 0.0 || burst < 1.0) {
+			FATAL("Malformed limit %s", str_quote(limits[i]));
+		}
+
+		/* Keys are too long for an exact table */
+		char name[32];
+		snprintf(name, sizeof(name), "limit%i", i);
+		l->hl = map_table(alloc_table(shm ? "atomic" : "direct",
+					      src_size, 1, rate, burst),
+				  state_dir, shm, name);
+		snprintf(l->name, sizeof(l->name), "%s", parts[0]);
+		snprintf(l->reason, sizeof(l->reason), "Ratelimited on %s",
+			 parts[0]);
+		free(org_parts);
+	}
+	state.limiters_len = limits_len;
+	if (adapt_floor > 0.0) {
+		state.adapt = adapt_alloc(iface, adapt_floor, adapt_ceiling,
+					  iface_rate);
+		state.adapt_export = adapt_export;
+		state.iface_burst_secs = iface_burst / iface_rate;
+		iface_rate = adapt_rate(state.adapt);
+		iface_burst = iface_rate * state.iface_burst_secs;
+	}
+	if (topk_export) {
+		state.top_sources = topk_alloc(TOPK_SIZE);
+		state.top_clients = topk_alloc(TOPK_SIZE);
+		state.topk_export = topk_export;
+	}
+	/* One bucket per VLAN id, tenants never share a bucket */
+	unsigned iface_size = iface_vlan ? VLAN_IDS : 32;
+	/* The burst must hold the largest frame, or it never passes */
+	if (src_byte_rate > 0.0) {
+		double burst = src_byte_rate * 1.9;
+		state.src_bytes = map_table(
+			alloc_table(src_table, src_size, src_depth,
+				    src_byte_rate,
+				    burst < SNAPLEN ? SNAPLEN : burst),
+			state_dir, shm, "src_bytes");
+	}
+	if (iface_byte_rate > 0.0) {
+		double burst = iface_byte_rate * 1.9;
+		state.iface_bytes = map_table(
+			alloc_table(iface_table, iface_size, 1, iface_byte_rate,
+				    burst < SNAPLEN ? SNAPLEN : burst),
+			state_dir, shm, "iface_bytes");
+	}
+	state.src_prefix4 = src_prefix4;
+	state.src_prefix6 = src_prefix6;
+	state.src_max_size = src_max_size;
+	for (i = 0; i < shadows_len; i++) {
+		struct shadow *sh = &state.shadows[i];
+		/* SRC_RATE:IFACE_RATE, kept private to this process */
+		double rate, sh_iface_rate;
+		char end;
+		if (sscanf(shadows[i], "%lf:%lf%c", &rate, &sh_iface_rate,
+			   &end) != 2 ||
+		    rate <= 0.0 || sh_iface_rate <= 0.0) {
+			FATAL("Malformed shadow profile %s",
+			      str_quote(shadows[i]));
+		}
+		/* As many seconds worth as the live limits, at least one
+		 * packet */
+		double burst = rate * src_burst / src_rate;
+		sh->sources = alloc_table(src_table, src_size, src_depth, rate,
+					  burst < 1.0 ? 1.0 : burst);
+		burst = sh_iface_rate * iface_burst / iface_rate;
+		sh->ifaces = alloc_table("direct", 1, 1, sh_iface_rate,
+					 burst < 1.0 ? 1.0 : burst);
+		snprintf(sh->name, sizeof(sh->name), "%s", shadows[i]);
+	}
+	state.shadows_len = shadows_len;
+	state.shadow_export = shadow_export;
+	state.ifaces = map_table(
+		alloc_table(iface_table, iface_size, 1, iface_rate,
+			    iface_burst),
+		state_dir, shm, "ifaces");
+	for (i = 0; i < vlan_rates_len; i++) {
+		struct vlan_limit *v = &state.vlan_limits[i];
+		/* VLAN:RATE[:BURST] */
+		double rate, burst = 0.0;
+		int n = sscanf(vlan_rates[i], "%u:%lf:%lf", &v->vlan, &rate,
+			       &burst);
+		if (n < 2 || v->vlan >= VLAN_IDS || rate <= 0.0 ||
+		    (n == 3 && burst < 1.0)) {
+			FATAL("Malformed VLAN rate %s",
+			      str_quote(vlan_rates[i]));
+		}
+		if (n == 2) {
+			burst = rate * 1.9;
+		}
+
+		char name[32];
+		snprintf(name, sizeof(name), "vlan%u", v->vlan);
+		v->hl = map_table(alloc_table(iface_table, 1, 1, rate, burst),
+				  state_dir, shm, name);
+	}
+	state.vlan_limits_len = vlan_rates_len;
+	if (iface_vlan) {
+		state.iface_vlan = 1;
+		state.vlan_sent = calloc(VLAN_IDS, sizeof(uint64_t));
+		state.vlan_refused = calloc(VLAN_IDS, sizeof(uint64_t));
+	}
 	state.verbose = verbose;
 	state.strict = strict;
 	state.dry_run = dry_run;
 	state.ports_map = ports_map;
 	state.raw_sd = setup_raw(iface);
+	state.inject_sd = -1;
+	if (bundle_ms || fair_queue) {
+		state.pool = pktpool_alloc(PKTPOOL_SIZE, SNAPLEN);
+	}
+	if (fair_queue) {
+		state.drr = drr_alloc(state.pool, FAIR_FLOWS,
+				      iface_byte_rate > 0.0 ? FAIR_QUANTUM_BYTES
+							    : 1,
+				      MSEC_NSEC(FAIR_MAX_DELAY_MS));
+		/* Source limits by prefix imply queues by prefix too */
+		if (strcmp(fair_queue, "prefix") == 0) {
+			state.fair_prefix4 =
+				src_prefix4 < 32 ? src_prefix4 : FAIR_PREFIX4;
+			state.fair_prefix6 =
+				src_prefix6 < 128 ? src_prefix6 : FAIR_PREFIX6;
+		}
+	}
+	if (bundle_ms) {
+		state.bundle = bundle_alloc(state.raw_sd, state.pool,
+					    iface_mtu(iface),
+					    MSEC_NSEC(bundle_ms));
+	}
+	if (bundle_recv) {
+		state.inject_sd = setup_raw(bundle_recv);
+	}
 
 	struct uevent uevent;
 	uevent_new(&uevent);
 
-	if (nflog_group == -1) {
+	if (bundle_recv) {
+		state.pcap = setup_pcap(iface, BUNDLE_BPF_FILTER,
+					BUNDLE_SNAPLEN, &stats);
+		int pcap_fd = pcap_get_selectable_fd(state.pcap);
+		if (pcap_fd < 0) {
+			PFATAL("pcap_get_selectable_fd()");
+		}
+		uevent_yield(&uevent, pcap_fd, UEVENT_READ, handle_pcap,
+			     &state);
+	} else if (nflog_group == -1) {
 		state.pcap = setup_pcap(iface, BPF_FILTER, SNAPLEN, &stats);
 		int pcap_fd = pcap_get_selectable_fd(state.pcap);
 		if (pcap_fd < 0) {
@@ -530,9 +1779,14 @@ int main(int argc, char *argv[])
 		     (void *)&done);
 	uevent_yield(&uevent, signal_desc(SIGTERM), UEVENT_READ, on_signal,
 		     (void *)&done);
+	uevent_yield(&uevent, signal_desc(SIGUSR1), UEVENT_READ, on_grow,
+		     &state.grow_requested);
 
 	fprintf(stderr, "[*] #%i Started pmtud ", getpid());
-	if (nflog_group == -1) {
+	if (bundle_recv) {
+		fprintf(stderr, "bundles on iface=%s ", str_quote(iface));
+		fprintf(stderr, "inject iface=%s ", str_quote(bundle_recv));
+	} else if (nflog_group == -1) {
 		fprintf(stderr, "pcap on iface=%s ", str_quote(iface));
 	} else {
 		fprintf(stderr, "nflog group %i, send iface=%s ", nflog_group,
@@ -543,10 +1797,78 @@ int main(int argc, char *argv[])
 		"rates={iface=%.1f pps source=%.1f pps}, verbose=%i, "
 		"dry_run=%i\n",
 		iface_rate, src_rate, verbose, dry_run);
+	if (src_byte_rate > 0.0 || iface_byte_rate > 0.0) {
+		fprintf(stderr,
+			"[*] #%i byte rates={iface=%.0f Bps source=%.0f Bps}\n",
+			getpid(), iface_byte_rate, src_byte_rate);
+	}
 
+	/* Timers are armed from uevent_now, set by uevent_select() only
+	 * once the loop runs */
+	clock_gettime(CLOCK_MONOTONIC, &uevent_now);
+	uint64_t next_adapt = 0;
+	uint64_t next_topk = 0;
+	uint64_t next_shadow = 0;
 	while (done == 0) {
-		struct timeval timeout =
-			NSEC_TIMEVAL(MSEC_NSEC(24 * 60 * 60 * 1000UL));
+		uint64_t timeout_ns = MSEC_NSEC(24 * 60 * 60 * 1000UL);
+		if (state.drr && drr_backlog(state.drr)) {
+			uint64_t now = TIMESPEC_NSEC(&uevent_now);
+			hashlimit_clock_cache(now);
+			drr_run(state.drr, now, fair_send, fair_drop, &state);
+			if (drr_backlog(state.drr) &&
+			    MSEC_NSEC(FAIR_TICK_MS) < timeout_ns) {
+				timeout_ns = MSEC_NSEC(FAIR_TICK_MS);
+			}
+		}
+		if (state.src_max_size || state.grow_requested) {
+			grow_sources(&state);
+		}
+		/* Entries not looked up in the meantime move over here */
+		hashlimit_clock_cache(TIMESPEC_NSEC(&uevent_now));
+		if (hashlimit_resize_step(state.sources, RESIZE_STEP) &&
+		    MSEC_NSEC(RESIZE_TICK_MS) < timeout_ns) {
+			timeout_ns = MSEC_NSEC(RESIZE_TICK_MS);
+		}
+		if (state.bundle) {
+			bundle_poll(state.bundle, &timeout_ns);
+		}
+		if (state.adapt) {
+			uint64_t now = TIMESPEC_NSEC(&uevent_now);
+			/* First sample a full interval from now */
+			if (next_adapt == 0) {
+				next_adapt = now + MSEC_NSEC(ADAPT_INTERVAL_MS);
+			} else if (now >= next_adapt) {
+				adapt_iface_rate(&state);
+				next_adapt = now + MSEC_NSEC(ADAPT_INTERVAL_MS);
+			}
+			if (next_adapt - now < timeout_ns) {
+				timeout_ns = next_adapt - now;
+			}
+		}
+		if (state.top_sources) {
+			uint64_t now = TIMESPEC_NSEC(&uevent_now);
+			if (next_topk == 0) {
+				next_topk = now + MSEC_NSEC(TOPK_INTERVAL_MS);
+			} else if (now >= next_topk) {
+				export_topk(&state);
+				next_topk = now + MSEC_NSEC(TOPK_INTERVAL_MS);
+			}
+			if (next_topk - now < timeout_ns) {
+				timeout_ns = next_topk - now;
+			}
+		}
+		if (state.shadow_export) {
+			uint64_t now = TIMESPEC_NSEC(&uevent_now);
+			if (now >= next_shadow) {
+				export_shadows(&state);
+				next_shadow =
+					now + MSEC_NSEC(SHADOW_INTERVAL_MS);
+			}
+			if (next_shadow - now < timeout_ns) {
+				timeout_ns = next_shadow - now;
+			}
+		}
+		struct timeval timeout = NSEC_TIMEVAL(timeout_ns);
 		int r = uevent_select(&uevent, &timeout);
 		if (r != 0) {
 			continue;
@@ -554,6 +1876,61 @@ int main(int argc, char *argv[])
 	}
 	fprintf(stderr, "[*] #%i Quitting\n", getpid());
 
+	/* Whatever is still queued is dropped */
+	if (state.drr) {
+		struct drr_stats fq_stats;
+		drr_stats(state.drr, &fq_stats);
+		fprintf(stderr,
+			"[*] #%i fair queue enqueued=%lu sent=%lu full=%lu "
+			"stale=%lu backlog=%u\n",
+			getpid(), fq_stats.enqueued, fq_stats.sent,
+			fq_stats.dropped_full, fq_stats.dropped_stale,
+			drr_backlog(state.drr));
+		drr_free(state.drr);
+	}
+
+	if (state.bundle) {
+		bundle_flush(state.bundle);
+		uint64_t bundles, records, enobufs;
+		bundle_stats(state.bundle, &bundles, &records, &enobufs);
+		fprintf(stderr, "[*] #%i bundles=%lu bundled=%lu enobufs=%lu\n",
+			getpid(), bundles, records, enobufs);
+		bundle_free(state.bundle);
+	}
+
+	if (state.shadows_len) {
+		char prefix[32];
+		snprintf(prefix, sizeof(prefix), "[*] #%i ", getpid());
+		print_shadows(&state, stderr, prefix);
+		if (state.shadow_export) {
+			export_shadows(&state);
+		}
+		for (i = 0; i < state.shadows_len; i++) {
+			hashlimit_free(state.shadows[i].sources);
+			hashlimit_free(state.shadows[i].ifaces);
+		}
+	}
+
+	if (state.top_sources) {
+		export_topk(&state);
+		topk_free(state.top_sources);
+		topk_free(state.top_clients);
+	}
+
+	if (state.adapt) {
+		fprintf(stderr, "[*] #%i iface rate=%.1f pps enobufs=%lu\n",
+			getpid(), adapt_rate(state.adapt), state.tx_enobufs);
+		adapt_free(state.adapt);
+	}
+
+	if (state.pool) {
+		fprintf(stderr,
+			"[*] #%i pool used=%u/%u max=%u exhausted=%lu\n",
+			getpid(), state.pool->in_use, state.pool->count,
+			state.pool->max_in_use, state.pool->exhausted);
+		pktpool_free(state.pool);
+	}
+
 	if (nflog_group == -1) {
 		unsetup_pcap(state.pcap, iface, &stats);
 	} else {
@@ -562,10 +1939,68 @@ int main(int argc, char *argv[])
 	fprintf(stderr, "[*] #%i recv=%i drop=%i ifdrop=%i\n", getpid(),
 		stats.ps_recv, stats.ps_drop, stats.ps_ifdrop);
 
+	print_table_stats("sources", state.sources);
+	if (state.prefixes) {
+		print_table_stats("prefixes", state.prefixes);
+	}
+	if (state.src_bytes) {
+		print_table_stats("src_bytes", state.src_bytes);
+	}
+	if (state.clients) {
+		print_table_stats("clients", state.clients);
+		fprintf(stderr,
+			"[*] #%i two-level router_refused=%lu "
+			"client_refused=%lu client_unknown=%lu\n",
+			getpid(), state.router_refused, state.client_refused,
+			state.client_unknown);
+	}
+	for (i = 0; i < state.limiters_len; i++) {
+		print_table_stats(state.limiters[i].name,
+				  state.limiters[i].hl);
+	}
+	if (state.iface_vlan) {
+		unsigned vlan;
+		for (vlan = 0; vlan < VLAN_IDS; vlan++) {
+			if (state.vlan_sent[vlan] == 0 &&
+			    state.vlan_refused[vlan] == 0) {
+				continue;
+			}
+			fprintf(stderr,
+				"[*] #%i vlan %u sent=%lu refused=%lu\n",
+				getpid(), vlan, state.vlan_sent[vlan],
+				state.vlan_refused[vlan]);
+		}
+	}
+
 	close(state.raw_sd);
+	if (state.inject_sd >= 0) {
+		close(state.inject_sd);
+	}
 
 	hashlimit_free(state.sources);
+	if (state.prefixes) {
+		hashlimit_free(state.prefixes);
+	}
+	if (state.clients) {
+		hashlimit_free(state.clients);
+	}
+	for (i = 0; i < state.limiters_len; i++) {
+		hashlimit_free(state.limiters[i].hl);
+	}
 	hashlimit_free(state.ifaces);
+	for (i = 0; i < state.vlan_limits_len; i++) {
+		hashlimit_free(state.vlan_limits[i].hl);
+	}
+	if (state.iface_vlan) {
+		free(state.vlan_sent);
+		free(state.vlan_refused);
+	}
+	if (state.src_bytes) {
+		hashlimit_free(state.src_bytes);
+	}
+	if (state.iface_bytes) {
+		hashlimit_free(state.iface_bytes);
+	}
 	if (state.ports_map) {
 		bitmap_free(state.ports_map);
 	}
@@ -14,6 +14,7 @@
 #include <net/if.h>
 #include <string.h>
 #include <sys/ioctl.h>
+#include <unistd.h>
 
 #include "pmtud.h"
 
@@ -157,6 +158,39 @@ int setup_raw(const char *iface)
 	return s;
 }
 
+int iface_mtu(const char *iface)
+{
+	int s = socket(AF_INET, SOCK_DGRAM, 0);
+	if (s < 0) {
+		PFATAL("socket(AF_INET, SOCK_DGRAM)");
+	}
+
+	struct ifreq s_ifr;
+	memset(&s_ifr, 0, sizeof(s_ifr));
+	strncpy(s_ifr.ifr_name, iface, sizeof(s_ifr.ifr_name));
+	int r = ioctl(s, SIOCGIFMTU, &s_ifr);
+	if (r != 0) {
+		PFATAL("ioctl(SIOCGIFMTU, %s)", str_quote(iface));
+	}
+	close(s);
+	return s_ifr.ifr_mtu;
+}
+
+/* Copy the address with all but the first prefix_len bits cleared. */
+void ip_prefix(uint8_t *dst, const uint8_t *p, int p_len, int prefix_len)
+{
+	int i;
+	for (i = 0; i < p_len; i++) {
+		if (prefix_len >= 8) {
+			dst[i] = p[i];
+			prefix_len -= 8;
+		} else {
+			dst[i] = p[i] & (uint8_t)(0xff00 >> prefix_len);
+			prefix_len = 0;
+		}
+	}
+}
+
 const char *ip_to_string(const uint8_t *p, int p_len)
 {
 	static char dst[INET6_ADDRSTRLEN + 1];
@@ -0,0 +1,98 @@
+// PMTUD
+//
+// Copyright (c) 2015 CloudFlare, Inc.
+//
+// Preallocated pool of fixed-size, cache aligned packet buffers. A
+// captured frame that has to outlive the capture callback (because
+// its transmission is deferred) is copied into a pool buffer once,
+// and every pending send holds a reference to it. Nothing on the
+// packet path calls malloc.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "pktpool.h"
+
+#define ALIGN_UP(x, a) (((x) + (a)-1) & ~((a)-1))
+
+struct pktpool *pktpool_alloc(unsigned count, unsigned buf_size)
+{
+	struct pktpool *pool = calloc(1, sizeof(struct pktpool));
+
+	pool->count = count;
+	pool->buf_size = buf_size;
+	pool->stride =
+		sizeof(struct pktbuf) + ALIGN_UP(buf_size, PKTBUF_ALIGN);
+
+	if (posix_memalign((void **)&pool->mem, PKTBUF_ALIGN,
+			   (size_t)count * pool->stride) != 0) {
+		abort();
+	}
+	memset(pool->mem, 0, (size_t)count * pool->stride);
+
+	/* Build the free list back to front, so buffers are handed
+	 * out in address order. */
+	unsigned i;
+	for (i = count; i > 0; i--) {
+		struct pktbuf *buf = (struct pktbuf *)&pool->mem[(size_t)(
+			i - 1) * pool->stride];
+		buf->next_free = pool->free_list;
+		pool->free_list = buf;
+	}
+	return pool;
+}
+
+void pktpool_free(struct pktpool *pool)
+{
+	free(pool->mem);
+	free(pool);
+}
+
+struct pktbuf *pktbuf_get(struct pktpool *pool)
+{
+	struct pktbuf *buf = pool->free_list;
+	if (buf == NULL) {
+		pool->exhausted += 1;
+		return NULL;
+	}
+
+	pool->free_list = buf->next_free;
+	buf->next_free = NULL;
+	buf->refcnt = 1;
+	buf->len = 0;
+
+	pool->in_use += 1;
+	if (pool->in_use > pool->max_in_use) {
+		pool->max_in_use = pool->in_use;
+	}
+	return buf;
+}
+
+struct pktbuf *pktbuf_copy(struct pktpool *pool, const uint8_t *data,
+			   unsigned len)
+{
+	if (len > pool->buf_size) {
+		return NULL;
+	}
+
+	struct pktbuf *buf = pktbuf_get(pool);
+	if (buf) {
+		memcpy(buf->data, data, len);
+		buf->len = len;
+	}
+	return buf;
+}
+
+void pktbuf_ref(struct pktbuf *buf) { buf->refcnt += 1; }
+
+void pktbuf_put(struct pktpool *pool, struct pktbuf *buf)
+{
+	buf->refcnt -= 1;
+	if (buf->refcnt == 0) {
+		buf->next_free = pool->free_list;
+		pool->free_list = buf;
+		pool->in_use -= 1;
+	}
+}
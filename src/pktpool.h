@@ -0,0 +1,42 @@
+// PMTUD
+//
+// Copyright (c) 2015 CloudFlare, Inc.
+
+#ifndef _PKTPOOL_H
+#define _PKTPOOL_H
+
+#define PKTBUF_ALIGN 64
+
+struct pktbuf
+{
+	unsigned refcnt;
+	unsigned len;
+	struct pktbuf *next_free;
+
+	uint8_t data[0] __attribute__((aligned(PKTBUF_ALIGN)));
+};
+
+struct pktpool
+{
+	unsigned count;
+	unsigned buf_size;
+	unsigned stride;
+
+	unsigned in_use;
+	unsigned max_in_use;
+	uint64_t exhausted;
+
+	struct pktbuf *free_list;
+	uint8_t *mem;
+};
+
+struct pktpool *pktpool_alloc(unsigned count, unsigned buf_size);
+void pktpool_free(struct pktpool *pool);
+
+struct pktbuf *pktbuf_get(struct pktpool *pool);
+struct pktbuf *pktbuf_copy(struct pktpool *pool, const uint8_t *data,
+			   unsigned len);
+void pktbuf_ref(struct pktbuf *buf);
+void pktbuf_put(struct pktpool *pool, struct pktbuf *buf);
+
+#endif // _PKTPOOL_H
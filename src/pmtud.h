@@ -47,6 +47,8 @@ pcap_t *setup_pcap(const char *iface, const char *bpf_filter, int snap_len,
 		   struct pcap_stat *stats);
 void unsetup_pcap(pcap_t *pcap, const char *iface, struct pcap_stat *stats);
 int setup_raw(const char *iface);
+int iface_mtu(const char *iface);
+void ip_prefix(uint8_t *dst, const uint8_t *p, int p_len, int prefix_len);
 const char *ip_to_string(const uint8_t *p, int p_len);
 
 /* sched.c */
@@ -66,3 +68,106 @@ struct nflog *nflog_alloc(uint16_t group_no, unsigned queue_maxlen,
 void nflog_free(struct nflog *n);
 int nflog_get_fd(struct nflog *n);
 int nflog_go_handle(struct nflog *n, const uint8_t *buf, unsigned buf_sz);
+
+/* bundle.c */
+/* IEEE 802 Local Experimental EtherType 1 */
+#define BUNDLE_ETHERTYPE 0x88b5
+
+struct pktbuf;
+struct pktpool;
+struct bundle *bundle_alloc(int sd, struct pktpool *pool, unsigned mtu,
+			    uint64_t window_ns);
+void bundle_free(struct bundle *b);
+int bundle_add(struct bundle *b, struct pktbuf *buf, unsigned l3_offset);
+int bundle_flush(struct bundle *b);
+int bundle_poll(struct bundle *b, uint64_t *timeout_ns);
+void bundle_stats(struct bundle *b, uint64_t *bundles, uint64_t *records,
+		  uint64_t *enobufs);
+int bundle_unpack(const uint8_t *p, unsigned data_len,
+		  int (*record_cb)(int type, const uint8_t *l3,
+				   unsigned l3_len, void *),
+		  void *userdata);
+int bundle_inject(int sd, int type, const uint8_t *l3, unsigned l3_len);
+
+/* limitkey.c */
+#define LK_SRC (1 << 0)
+#define LK_DST (1 << 1)
+#define LK_INNER_SRC (1 << 2)
+#define LK_PROTO (1 << 3)
+#define LK_SPORT (1 << 4)
+#define LK_DPORT (1 << 5)
+#define LK_VLAN (1 << 6)
+#define LK_MTU (1 << 7)
+#define LK_5TUPLE (LK_INNER_SRC | LK_DST | LK_PROTO | LK_SPORT | LK_DPORT)
+
+/* Enough for every field */
+#define LIMITKEY_MAX 64
+
+struct pkt_fields
+{
+	const uint8_t *src;
+	int src_len;
+	/* NULL if the ICMP payload can't be parsed */
+	const uint8_t *inner_src;
+	const uint8_t *inner_dst;
+	int inner_len;
+	/* -1 when missing */
+	int proto;
+	int sport;
+	int dport;
+	int vlan;
+	int mtu;
+};
+
+int limitkey_parse(const char *spec, unsigned *fields);
+void limitkey_fields(struct pkt_fields *f, const uint8_t *p,
+		     unsigned data_len, unsigned l3_offset,
+		     unsigned icmp_offset);
+int limitkey_compose(unsigned fields, const struct pkt_fields *f,
+		     uint8_t key[LIMITKEY_MAX]);
+
+/* adapt.c */
+struct adapt *adapt_alloc(const char *iface, double floor, double ceiling,
+			  double rate);
+void adapt_free(struct adapt *a);
+double adapt_rate(struct adapt *a);
+int adapt_sample(struct adapt *a, uint64_t drops, uint64_t enobufs);
+int adapt_export(struct adapt *a, const char *path);
+
+/* topk.c */
+struct topk *topk_alloc(unsigned k);
+void topk_free(struct topk *tk);
+void topk_add(struct topk *tk, const uint8_t *key, int key_len);
+void topk_reset(struct topk *tk);
+void topk_print(struct topk *tk, FILE *f, const char *name, unsigned limit);
+
+/* drr.c */
+/* Packets queued per flow */
+#define DRR_QLEN 4
+
+struct drr_stats
+{
+	uint64_t enqueued;
+	uint64_t sent;
+	uint64_t dropped_full;
+	uint64_t dropped_stale;
+};
+
+struct drr *drr_alloc(struct pktpool *pool, unsigned flows, unsigned quantum,
+		      uint64_t max_delay_ns);
+void drr_free(struct drr *d);
+/* Returns -1, counted as dropped_full, if the queue of the flow is
+ * full. Otherwise the next drr_enqueue() for the flow succeeds. */
+int drr_admit(struct drr *d, const uint8_t *flow_key, int key_len);
+int drr_enqueue(struct drr *d, const uint8_t *flow_key, int key_len,
+		struct pktbuf *buf, unsigned l3_offset, unsigned cost,
+		uint64_t now);
+/* send_cb returns 1 if sent, 0 if nothing can be sent for now and -1
+ * if only this packet's flow has to wait. drop_cb, if given, sees
+ * every packet dropped for waiting too long. */
+int drr_run(struct drr *d, uint64_t now,
+	    int (*send_cb)(struct pktbuf *buf, unsigned l3_offset, void *),
+	    void (*drop_cb)(struct pktbuf *buf, unsigned l3_offset, void *),
+	    void *userdata);
+unsigned drr_backlog(struct drr *d);
+void drr_stats(struct drr *d, struct drr_stats *stats);
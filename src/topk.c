@@ -0,0 +1,264 @@
+// PMTUD
+//
+// Copyright (c) 2015 CloudFlare, Inc.
+//
+// Heavy hitters of ratelimited packets, using the Space-Saving
+// algorithm (Metwally et al., "Efficient Computation of Frequent and
+// Top-k Elements in Data Streams"). At most k keys are monitored. A
+// key that isn't monitored replaces the one with the lowest count and
+// inherits its count, which is remembered as the error: the true
+// count is between count - error and count. Any key seen more than
+// n / k times out of n is guaranteed to be monitored.
+//
+// Monitored keys hang off buckets holding all the keys with the same
+// count, and buckets form a list sorted by count. Since counts only
+// grow by one, a key moves at most to the next bucket and every
+// update is O(1). All memory is allocated upfront.
+
+#include <getopt.h>
+#include <pcap.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "pmtud.h"
+
+uint64_t siphash24(const void *src, unsigned long src_sz,
+		   const unsigned char key[16]);
+
+struct tk_bucket;
+
+struct tk_entry
+{
+	uint8_t key[16];
+	int key_len;
+	uint64_t error;
+	struct tk_bucket *bucket;
+	/* Entries of the same bucket */
+	struct tk_entry *prev;
+	struct tk_entry *next;
+	/* Hash chain */
+	struct tk_entry *hnext;
+};
+
+struct tk_bucket
+{
+	uint64_t count;
+	struct tk_entry *entries;
+	/* Towards higher counts */
+	struct tk_bucket *next;
+	struct tk_bucket *prev;
+};
+
+struct topk
+{
+	unsigned k;
+	unsigned used;
+	uint64_t total;
+	uint8_t key[16];
+
+	/* Lowest count first */
+	struct tk_bucket *min;
+	struct tk_bucket *max;
+	struct tk_bucket *free_buckets;
+
+	unsigned index_size;
+	struct tk_entry **index;
+	struct tk_entry *entries;
+	struct tk_bucket *buckets;
+};
+
+struct topk *topk_alloc(unsigned k)
+{
+	struct topk *tk = calloc(1, sizeof(struct topk));
+	tk->k = k;
+	tk->index_size = 2 * k;
+	tk->index = calloc(tk->index_size, sizeof(struct tk_entry *));
+	tk->entries = calloc(k, sizeof(struct tk_entry));
+	/* Never more buckets than entries, plus one being created */
+	tk->buckets = calloc(k + 1, sizeof(struct tk_bucket));
+
+	unsigned i;
+	for (i = 0; i < k + 1; i++) {
+		tk->buckets[i].next = tk->free_buckets;
+		tk->free_buckets = &tk->buckets[i];
+	}
+
+	/* Random numbers for poor */
+	uint64_t a = (uint64_t)time(NULL) | getpid();
+	memcpy(&tk->key[0], &a, 8);
+	a = (uintptr_t)tk ^ getppid();
+	memcpy(&tk->key[8], &a, 8);
+	return tk;
+}
+
+void topk_free(struct topk *tk)
+{
+	free(tk->index);
+	free(tk->entries);
+	free(tk->buckets);
+	free(tk);
+}
+
+static void entry_unlink(struct tk_entry *e)
+{
+	struct tk_bucket *b = e->bucket;
+	if (e->prev) {
+		e->prev->next = e->next;
+	} else {
+		b->entries = e->next;
+	}
+	if (e->next) {
+		e->next->prev = e->prev;
+	}
+	e->prev = e->next = NULL;
+}
+
+static void entry_link(struct tk_bucket *b, struct tk_entry *e)
+{
+	e->bucket = b;
+	e->prev = NULL;
+	e->next = b->entries;
+	if (b->entries) {
+		b->entries->prev = e;
+	}
+	b->entries = e;
+}
+
+/* New bucket of given count after prev, or the first if prev is NULL */
+static struct tk_bucket *bucket_insert(struct topk *tk, struct tk_bucket *prev,
+				       uint64_t count)
+{
+	struct tk_bucket *b = tk->free_buckets;
+	tk->free_buckets = b->next;
+
+	b->count = count;
+	b->entries = NULL;
+	b->prev = prev;
+	b->next = prev ? prev->next : tk->min;
+	if (b->next) {
+		b->next->prev = b;
+	} else {
+		tk->max = b;
+	}
+	if (prev) {
+		prev->next = b;
+	} else {
+		tk->min = b;
+	}
+	return b;
+}
+
+static void bucket_remove(struct topk *tk, struct tk_bucket *b)
+{
+	if (b->prev) {
+		b->prev->next = b->next;
+	} else {
+		tk->min = b->next;
+	}
+	if (b->next) {
+		b->next->prev = b->prev;
+	} else {
+		tk->max = b->prev;
+	}
+	b->next = tk->free_buckets;
+	tk->free_buckets = b;
+}
+
+static void entry_increment(struct topk *tk, struct tk_entry *e)
+{
+	struct tk_bucket *b = e->bucket;
+	struct tk_bucket *next = b->next;
+	if (next == NULL || next->count != b->count + 1) {
+		next = bucket_insert(tk, b, b->count + 1);
+	}
+	entry_unlink(e);
+	entry_link(next, e);
+	if (b->entries == NULL) {
+		bucket_remove(tk, b);
+	}
+}
+
+static void index_remove(struct topk *tk, struct tk_entry *e, unsigned slot)
+{
+	struct tk_entry **p = &tk->index[slot];
+	for (; *p; p = &(*p)->hnext) {
+		if (*p == e) {
+			*p = e->hnext;
+			break;
+		}
+	}
+}
+
+void topk_add(struct topk *tk, const uint8_t *key, int key_len)
+{
+	unsigned slot = siphash24(key, key_len, tk->key) % tk->index_size;
+	struct tk_entry *e = tk->index[slot];
+	tk->total += 1;
+
+	for (; e; e = e->hnext) {
+		if (e->key_len == key_len &&
+		    memcmp(e->key, key, key_len) == 0) {
+			entry_increment(tk, e);
+			return;
+		}
+	}
+
+	if (tk->used < tk->k) {
+		e = &tk->entries[tk->used++];
+		struct tk_bucket *b = tk->min;
+		if (b == NULL || b->count != 0) {
+			b = bucket_insert(tk, NULL, 0);
+		}
+		entry_link(b, e);
+		e->error = 0;
+	} else {
+		/* Take over the key with the lowest count */
+		e = tk->min->entries;
+		unsigned old_slot =
+			siphash24(e->key, e->key_len, tk->key) % tk->index_size;
+		index_remove(tk, e, old_slot);
+		e->error = e->bucket->count;
+	}
+
+	memcpy(e->key, key, key_len);
+	e->key_len = key_len;
+	e->hnext = tk->index[slot];
+	tk->index[slot] = e;
+	entry_increment(tk, e);
+}
+
+void topk_reset(struct topk *tk)
+{
+	memset(tk->index, 0, tk->index_size * sizeof(struct tk_entry *));
+	memset(tk->entries, 0, tk->k * sizeof(struct tk_entry));
+	tk->used = 0;
+	tk->total = 0;
+	tk->min = tk->max = NULL;
+	tk->free_buckets = NULL;
+
+	unsigned i;
+	for (i = 0; i < tk->k + 1; i++) {
+		tk->buckets[i].next = tk->free_buckets;
+		tk->free_buckets = &tk->buckets[i];
+	}
+}
+
+void topk_print(struct topk *tk, FILE *f, const char *name, unsigned limit)
+{
+	fprintf(f, "%s total=%lu\n", name, tk->total);
+
+	struct tk_bucket *b = tk->max;
+	unsigned n = 0;
+	for (; b && n < limit; b = b->prev) {
+		struct tk_entry *e = b->entries;
+		for (; e && n < limit; e = e->next, n++) {
+			fprintf(f, "%s %s count=%lu error=%lu\n", name,
+				ip_to_string(e->key, e->key_len), b->count,
+				e->error);
+		}
+	}
+}
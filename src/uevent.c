@@ -40,7 +40,7 @@ int uevent_select(struct uevent *uevent, struct timeval *timeout)
 		}
 	}
 
-	clock_gettime(CLOCK_REALTIME, &uevent_now);
+	clock_gettime(CLOCK_MONOTONIC, &uevent_now);
 
 	int i;
 	for (i = 0; i < uevent->max_fd + 1; i++) {
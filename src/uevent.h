@@ -23,6 +23,9 @@ struct uevent
 	int max_fd;
 };
 
+/* CLOCK_MONOTONIC time of the last wakeup */
+extern struct timespec uevent_now;
+
 enum { UEVENT_WRITE = 1 << 0, UEVENT_READ = 1 << 1 };
 
 struct uevent *uevent_new(struct uevent *uevent);
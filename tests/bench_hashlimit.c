@@ -0,0 +1,845 @@
+// PMTUD
+//
+// Copyright (c) 2015 CloudFlare, Inc.
+//
+// Microbenchmarks of the rate limiting module. To run:
+//
+//     make bench
+//     ./bench_hashlimit [benchmark...]
+//
+// Without arguments all the benchmarks are run.
+
+#include <math.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#if defined(__x86_64__)
+#include <x86intrin.h>
+#endif
+
+#include "hashlimit.h"
+
+uint64_t siphash24(const void *src, unsigned long src_sz,
+		   const unsigned char key[16]);
+uint64_t siphash24_4(const void *src, const unsigned char key[16]);
+uint64_t siphash24_16(const void *src, const unsigned char key[16]);
+int siphash24_batch_init(int max_lanes);
+void siphash24_batch(const uint8_t *const *src, unsigned long src_sz,
+		     const unsigned char key[16], uint64_t *out, unsigned n);
+
+#define TIMESPEC_NSEC(ts) ((ts)->tv_sec * 1000000000ULL + (ts)->tv_nsec)
+
+#define KEYS 65536
+/* Packets handled per event loop wakeup */
+#define BATCH 32
+
+static uint64_t monotonic_now()
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return TIMESPEC_NSEC(&now);
+}
+
+/* Reference cycles, where there is a TSC */
+static uint64_t cycles_now()
+{
+#if defined(__x86_64__)
+	return __rdtsc();
+#else
+	return 0;
+#endif
+}
+
+/* Keeps the compiler from optimizing away measured calls */
+static volatile uint64_t sink;
+
+static uint64_t xorshift_state = 88172645463325252ULL;
+
+static uint64_t xorshift()
+{
+	xorshift_state ^= xorshift_state << 13;
+	xorshift_state ^= xorshift_state >> 7;
+	xorshift_state ^= xorshift_state << 17;
+	return xorshift_state;
+}
+
+static uint8_t (*random_keys(int key_len))[16]
+{
+	uint8_t(*keys)[16] = calloc(KEYS, 16);
+	int i, j;
+	for (i = 0; i < KEYS; i++) {
+		for (j = 0; j < key_len; j++) {
+			keys[i][j] = xorshift();
+		}
+	}
+	return keys;
+}
+
+static void bench_clock(unsigned packets)
+{
+	static const char *names[] = {"monotonic", "cached", "coarse", "tsc"};
+	uint8_t(*keys)[16] = random_keys(4);
+
+	printf("clock        now()     per packet   (%u packets, batch=%u)\n",
+	       packets, BATCH);
+
+	unsigned c;
+	for (c = 0; c < sizeof(names) / sizeof(names[0]); c++) {
+		enum hl_clock source;
+		hashlimit_clock_parse(names[c], &source);
+		if (hashlimit_clock_source(source) < 0) {
+			printf("%-10s   unsupported\n", names[c]);
+			continue;
+		}
+
+		struct hashlimit *sources =
+			hashlimit_alloc(8191, 1.1, 1.1 * 1.9);
+		struct hashlimit *ifaces =
+			hashlimit_alloc(32, 10.0, 10.0 * 1.9);
+
+		unsigned i;
+		uint64_t t0 = monotonic_now();
+		for (i = 0; i < packets; i++) {
+			sink = hashlimit_now();
+		}
+		uint64_t t1 = monotonic_now();
+
+		int accepted = 0;
+		for (i = 0; i < packets; i++) {
+			if (source == HL_CLOCK_CACHED && i % BATCH == 0) {
+				hashlimit_clock_cache(monotonic_now());
+			}
+			struct hl_bucket buckets[2];
+			hashlimit_bucket_hash(sources, keys[i % KEYS], 4,
+					      &buckets[0]);
+			hashlimit_bucket(ifaces, 0, &buckets[1]);
+			accepted += hashlimit_consume(buckets, 2) == 2;
+		}
+		uint64_t t2 = monotonic_now();
+
+		printf("%-10s %5.1f ns     %5.1f ns   (accepted=%i)\n",
+		       names[c], (double)(t1 - t0) / packets,
+		       (double)(t2 - t1) / packets, accepted);
+
+		hashlimit_free(sources);
+		hashlimit_free(ifaces);
+	}
+	hashlimit_clock_source(HL_CLOCK_MONOTONIC);
+	free(keys);
+}
+
+/* Table much larger than the caches, so every packet is a miss and
+ * bucket size matters. */
+static void bench_layout(unsigned packets)
+{
+	static const char *names[] = {"direct", "gcra", "gcra-coarse"};
+	const unsigned size = 1 << 22;
+
+	hashlimit_clock_source(HL_CLOCK_CACHED);
+
+	printf("layout        per packet   (%u packets, %u buckets)\n",
+	       packets, size);
+
+	unsigned l;
+	for (l = 0; l < sizeof(names) / sizeof(names[0]); l++) {
+		struct hashlimit *hl;
+		switch (l) {
+		case 0:
+			hl = hashlimit_alloc(size, 1.1, 1.1 * 1.9);
+			break;
+		case 1:
+			hl = hashlimit_alloc_gcra(size, 1.1, 1.1 * 1.9);
+			break;
+		default:
+			hl = hashlimit_alloc_gcra_coarse(size, 1.1,
+							 1.1 * 1.9);
+		}
+
+		unsigned i;
+		int accepted = 0;
+		uint64_t t0 = monotonic_now();
+		for (i = 0; i < packets; i++) {
+			if (i % BATCH == 0) {
+				hashlimit_clock_cache(monotonic_now());
+			}
+			struct hl_bucket b;
+			hashlimit_bucket(hl, xorshift(), &b);
+			accepted += hashlimit_consume(&b, 1) == 1;
+		}
+		uint64_t t1 = monotonic_now();
+
+		printf("%-12s  %5.1f ns     (accepted=%i)\n", names[l],
+		       (double)(t1 - t0) / packets, accepted);
+		hashlimit_free(hl);
+	}
+	hashlimit_clock_source(HL_CLOCK_MONOTONIC);
+}
+
+/* Per packet against batched lookups, at sizes from fitting in L1 to
+ * well beyond the last level cache. Every packet has a new random
+ * source. */
+static void bench_batch(unsigned packets)
+{
+	static const unsigned sizes[] = {1021, 8191, 65521, 1048573,
+					 16777213};
+	uint32_t keys[BATCH];
+	const uint8_t *h[BATCH];
+	int h_len[BATCH];
+	int results[BATCH];
+	struct hl_bucket b[BATCH];
+	unsigned i, j;
+
+	for (j = 0; j < BATCH; j++) {
+		h[j] = (const uint8_t *)&keys[j];
+		h_len[j] = 4;
+	}
+
+	hashlimit_clock_source(HL_CLOCK_CACHED);
+
+	printf("buckets    single     batch   (%u packets, batch=%u)\n",
+	       packets, BATCH);
+
+	unsigned s;
+	for (s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+		struct hashlimit *hl =
+			hashlimit_alloc(sizes[s], 1.1, 1.1 * 1.9);
+
+		uint64_t t0 = monotonic_now();
+		for (i = 0; i < packets; i += BATCH) {
+			hashlimit_clock_cache(monotonic_now());
+			for (j = 0; j < BATCH; j++) {
+				keys[j] = xorshift();
+				hashlimit_bucket_hash(hl, h[j], 4, &b[0]);
+				sink += hashlimit_consume(&b[0], 1);
+			}
+		}
+		uint64_t t1 = monotonic_now();
+		for (i = 0; i < packets; i += BATCH) {
+			hashlimit_clock_cache(monotonic_now());
+			for (j = 0; j < BATCH; j++) {
+				keys[j] = xorshift();
+			}
+			hashlimit_bucket_hash_batch(hl, h, h_len, BATCH, b, 1);
+			hashlimit_consume_batch(b, 1, BATCH, results);
+			sink += results[0];
+		}
+		uint64_t t2 = monotonic_now();
+
+		printf("%8u  %5.1f ns  %5.1f ns\n", sizes[s],
+		       (double)(t1 - t0) / packets,
+		       (double)(t2 - t1) / packets);
+		hashlimit_free(hl);
+	}
+	hashlimit_clock_source(HL_CLOCK_MONOTONIC);
+}
+
+struct contention_worker
+{
+	pthread_t thread;
+	struct hashlimit *sources;
+	struct hashlimit *ifaces;
+	uint8_t (*keys)[16];
+	/* Where in keys the worker starts, picked by the parent */
+	unsigned offset;
+	unsigned ops;
+	unsigned accepted;
+};
+
+static void *contention_run(void *userdata)
+{
+	struct contention_worker *w = userdata;
+	unsigned i, offset = w->offset;
+
+	for (i = 0; i < w->ops; i++) {
+		if (i % BATCH == 0) {
+			hashlimit_clock_cache(monotonic_now());
+		}
+		struct hl_bucket buckets[2];
+		hashlimit_bucket_hash(w->sources, w->keys[(offset + i) % KEYS],
+				      4, &buckets[0]);
+		hashlimit_bucket(w->ifaces, 0, &buckets[1]);
+		w->accepted += hashlimit_consume(buckets, 2) == 2;
+	}
+	return NULL;
+}
+
+/* All the threads enforce one global interface limit, set high enough
+ * to be reached at any thread count. */
+static void bench_contention(unsigned ops)
+{
+	const double iface_rate = 1000000.0;
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	uint8_t(*keys)[16] = random_keys(4);
+
+	hashlimit_clock_source(HL_CLOCK_CACHED);
+
+	printf("threads  Mops/s   ns/op   accepted   allowed  "
+	       "(%u ops per thread, iface=%.0f pps)\n",
+	       ops, iface_rate);
+
+	unsigned threads;
+	for (threads = 1; threads <= 2 * cpus; threads *= 2) {
+		struct hashlimit *sources =
+			hashlimit_alloc_atomic(8191, 1000.0, 1000.0 * 1.9);
+		struct hashlimit *ifaces = hashlimit_alloc_atomic(
+			32, iface_rate, iface_rate * 1.9);
+		struct contention_worker w[threads];
+
+		uint64_t t0 = monotonic_now();
+		unsigned i;
+		for (i = 0; i < threads; i++) {
+			w[i].sources = sources;
+			w[i].ifaces = ifaces;
+			w[i].keys = keys;
+			w[i].offset = xorshift() % KEYS;
+			w[i].ops = ops;
+			w[i].accepted = 0;
+			pthread_create(&w[i].thread, NULL, contention_run,
+				       &w[i]);
+		}
+		unsigned accepted = 0;
+		for (i = 0; i < threads; i++) {
+			pthread_join(w[i].thread, NULL);
+			accepted += w[i].accepted;
+		}
+		uint64_t t1 = monotonic_now();
+
+		/* The burst plus the rate over the whole run, no lock
+		 * may let through more */
+		double secs = (double)(t1 - t0) / 1e9;
+		double allowed = iface_rate * (secs + 1.9);
+		printf("%7u  %6.1f  %6.1f  %9u %9.0f%s\n", threads,
+		       (double)threads * ops / secs / 1e6,
+		       (double)(t1 - t0) / ((double)threads * ops), accepted,
+		       allowed, accepted > allowed ? "   OVER" : "");
+
+		hashlimit_free(sources);
+		hashlimit_free(ifaces);
+	}
+	hashlimit_clock_source(HL_CLOCK_MONOTONIC);
+	free(keys);
+}
+
+/* Synthetic PTB sources for the fidelity benchmark. Packets arrive as
+ * a Poisson process at pps, each from a source drawn uniformly or from
+ * a Zipf distribution. Bursty sources send a geometric number of
+ * packets back to back. */
+struct scenario
+{
+	const char *name;
+	unsigned sources;
+	/* Zipf exponent, 0 for uniform */
+	double zipf;
+	/* Percent of IPv6 sources */
+	unsigned v6;
+	/* Mean packets per burst, 1 for none */
+	double burst_mean;
+	double pps;
+};
+
+struct workload
+{
+	unsigned n;
+	uint32_t *src;
+	uint64_t *t;
+	uint8_t (*keys)[16];
+	int *key_len;
+	/* Decisions of the exact reference limiter */
+	uint8_t *ref;
+	uint8_t *ref_refused_src;
+	unsigned ref_accepted;
+};
+
+static double uniform()
+{
+	return (xorshift() >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static struct workload *workload_gen(const struct scenario *sc,
+				     unsigned packets)
+{
+	struct workload *w = calloc(1, sizeof(struct workload));
+	w->n = packets;
+	w->src = calloc(packets, sizeof(uint32_t));
+	w->t = calloc(packets, sizeof(uint64_t));
+	w->ref = calloc(packets, 1);
+	w->ref_refused_src = calloc(sc->sources, 1);
+	w->keys = calloc(sc->sources, 16);
+	w->key_len = calloc(sc->sources, sizeof(int));
+
+	unsigned i, j;
+	for (i = 0; i < sc->sources; i++) {
+		w->key_len[i] = xorshift() % 100 < sc->v6 ? 16 : 4;
+		for (j = 0; j < 16; j++) {
+			w->keys[i][j] = xorshift();
+		}
+	}
+
+	double *cdf = calloc(sc->sources, sizeof(double));
+	double sum = 0.0;
+	for (i = 0; i < sc->sources; i++) {
+		sum += sc->zipf > 0.0 ? 1.0 / pow(i + 1, sc->zipf) : 1.0;
+		cdf[i] = sum;
+	}
+
+	/* Far from zero, so that new buckets start full */
+	uint64_t now = 1000 * 1000000000ULL;
+	unsigned src = 0, burst_left = 0;
+	for (i = 0; i < packets; i++) {
+		now += -log(1.0 - uniform()) / sc->pps * 1e9;
+		if (burst_left == 0) {
+			double u = uniform() * sum;
+			unsigned lo = 0, hi = sc->sources - 1;
+			while (lo < hi) {
+				unsigned mid = (lo + hi) / 2;
+				if (cdf[mid] < u) {
+					lo = mid + 1;
+				} else {
+					hi = mid;
+				}
+			}
+			src = lo;
+			burst_left = 1;
+			while (uniform() > 1.0 / sc->burst_mean) {
+				burst_left++;
+			}
+		}
+		burst_left--;
+		w->src[i] = src;
+		w->t[i] = now;
+	}
+	free(cdf);
+	return w;
+}
+
+static void workload_free(struct workload *w)
+{
+	free(w->src);
+	free(w->t);
+	free(w->ref);
+	free(w->ref_refused_src);
+	free(w->keys);
+	free(w->key_len);
+	free(w);
+}
+
+/* Token bucket per source, indexed by source number, so it never
+ * confuses two sources. Same integer arithmetic as hashlimit. */
+static unsigned reference_run(struct workload *w, unsigned sources,
+			      double rate, double burst)
+{
+	uint64_t touch_cost = 1e9 / rate;
+	uint64_t credit_max = burst * touch_cost;
+	uint64_t *credit = calloc(sources, sizeof(uint64_t));
+	uint64_t *prev = calloc(sources, sizeof(uint64_t));
+
+	unsigned i, accepted = 0;
+	memset(w->ref_refused_src, 0, sources);
+	for (i = 0; i < w->n; i++) {
+		unsigned s = w->src[i];
+		credit[s] += w->t[i] - prev[s];
+		prev[s] = w->t[i];
+		if (credit[s] > credit_max) {
+			credit[s] = credit_max;
+		}
+		w->ref[i] = credit[s] >= touch_cost;
+		if (w->ref[i]) {
+			credit[s] -= touch_cost;
+			accepted++;
+		} else {
+			w->ref_refused_src[s] = 1;
+		}
+	}
+	free(credit);
+	free(prev);
+	w->ref_accepted = accepted;
+	return accepted;
+}
+
+/* How far the tables are from an exact limiter. A false drop is a
+ * packet the reference accepts and the table refuses, mostly caused by
+ * sources sharing a bucket, a false pass the opposite. Well-behaved
+ * sources are those the reference never limits, any drop of theirs is
+ * false. */
+static void bench_fidelity(unsigned packets)
+{
+	static const struct scenario scenarios[] = {
+		{"uniform", 20000, 0.0, 0, 1.0, 10000.0},
+		{"zipf", 20000, 1.0, 0, 1.0, 20000.0},
+		{"zipf-v6", 20000, 1.0, 50, 1.0, 20000.0},
+		{"zipf-bursty", 20000, 1.0, 0, 4.0, 20000.0},
+	};
+	static const char *tables[] = {"direct", "exact",  "sketch",
+				       "gcra",   "coarse", "atomic"};
+	static const unsigned sizes[] = {8191, 65521};
+	const double rate = 1.1, burst = 1.1 * 1.9;
+
+	hashlimit_clock_source(HL_CLOCK_CACHED);
+
+	printf("scenario     table     size  false-drop  false-pass  "
+	       "wb-drop   per packet   (%u packets, rate=%.1f burst=%.2f)\n",
+	       packets, rate, burst);
+
+	unsigned s;
+	for (s = 0; s < sizeof(scenarios) / sizeof(scenarios[0]); s++) {
+		const struct scenario *sc = &scenarios[s];
+		struct workload *w = workload_gen(sc, packets);
+		reference_run(w, sc->sources, rate, burst);
+
+		unsigned wb_packets = 0, i;
+		for (i = 0; i < w->n; i++) {
+			wb_packets += !w->ref_refused_src[w->src[i]];
+		}
+
+		unsigned t, z;
+		for (t = 0; t < sizeof(tables) / sizeof(tables[0]); t++) {
+			for (z = 0; z < sizeof(sizes) / sizeof(sizes[0]); z++) {
+				struct hashlimit *hl;
+				switch (t) {
+				case 0:
+					hl = hashlimit_alloc(sizes[z], rate,
+							     burst);
+					break;
+				case 1:
+					hl = hashlimit_alloc_exact(sizes[z],
+								   rate, burst);
+					break;
+				case 2:
+					/* Same memory as the others */
+					hl = hashlimit_alloc_sketch(
+						sizes[z] / 4, 4, rate, burst);
+					break;
+				case 3:
+					hl = hashlimit_alloc_gcra(sizes[z],
+								  rate, burst);
+					break;
+				case 4:
+					hl = hashlimit_alloc_gcra_coarse(
+						sizes[z], rate, burst);
+					break;
+				default:
+					hl = hashlimit_alloc_atomic(
+						sizes[z], rate, burst);
+				}
+
+				unsigned false_drop = 0, false_pass = 0;
+				unsigned wb_drop = 0;
+				uint64_t t0 = monotonic_now();
+				for (i = 0; i < w->n; i++) {
+					unsigned src = w->src[i];
+					hashlimit_clock_cache(w->t[i]);
+					struct hl_bucket b;
+					hashlimit_bucket_hash(hl, w->keys[src],
+							      w->key_len[src],
+							      &b);
+					int ok = hashlimit_consume(&b, 1) == 1;
+					false_drop += w->ref[i] && !ok;
+					false_pass += !w->ref[i] && ok;
+					wb_drop += !ok &&
+						   !w->ref_refused_src[src];
+				}
+				uint64_t t1 = monotonic_now();
+
+				unsigned refused = w->n - w->ref_accepted;
+				printf("%-12s %-7s %6u  %9.4f%%  %9.4f%%  "
+				       "%7.4f%%  %6.1f ns\n",
+				       sc->name, tables[t], sizes[z],
+				       100.0 * false_drop /
+					       (w->ref_accepted ?: 1),
+				       100.0 * false_pass / (refused ?: 1),
+				       100.0 * wb_drop / (wb_packets ?: 1),
+				       (double)(t1 - t0) / w->n);
+				hashlimit_free(hl);
+			}
+		}
+		workload_free(w);
+	}
+
+	/* Sources sending below the rate on average, but in bursts: how
+	 * many of their packets an exact limiter drops for a given
+	 * burst allowance. */
+	const struct scenario sc = {"bursty", 2000, 0.0, 0, 4.0, 2000.0};
+	static const double factors[] = {1.0, 1.9, 4.0, 8.0};
+	struct workload *w = workload_gen(&sc, packets);
+	printf("\nburst   dropped   (%u sources at %.1f pps, rate=%.1f, "
+	       "mean burst %.0f)\n",
+	       sc.sources, sc.pps / sc.sources, rate, sc.burst_mean);
+	unsigned f;
+	for (f = 0; f < sizeof(factors) / sizeof(factors[0]); f++) {
+		unsigned accepted =
+			reference_run(w, sc.sources, rate, rate * factors[f]);
+		printf("%4.1fx  %7.3f%%\n", factors[f],
+		       100.0 * (w->n - accepted) / w->n);
+	}
+	workload_free(w);
+
+	hashlimit_clock_source(HL_CLOCK_MONOTONIC);
+}
+
+/* Every lane of every batch against siphash24(), over all the keys. A
+ * batch one short of a multiple of 8 leaves a tail for the narrower
+ * paths. */
+static unsigned batch_mismatches(uint8_t (*data)[16], int len,
+				 const unsigned char key[16])
+{
+	const uint8_t *src[BATCH];
+	uint64_t out[BATCH];
+	unsigned i, j, n = BATCH - 1, mismatch = 0;
+
+	for (i = 0; i + n <= KEYS; i += n) {
+		for (j = 0; j < n; j++) {
+			src[j] = data[i + j];
+		}
+		siphash24_batch(src, len, key, out, n);
+		for (j = 0; j < n; j++) {
+			mismatch += out[j] != siphash24(src[j], len, key);
+		}
+	}
+	return mismatch;
+}
+
+/* Scalar siphash24() against the multi-lane and the fixed length
+ * versions, on keys of the same length, checking that they agree.
+ * Lengths around a word boundary cover the tail of the message. */
+static void bench_siphash(unsigned keys)
+{
+	static const int lens[] = {0, 4, 7, 8, 9, 15, 16};
+	static const int fixed_lens[] = {4, 16};
+	static const int widths[] = {1, 4, 8};
+	uint8_t(*data)[16] = random_keys(16);
+	const uint8_t *src[BATCH];
+	uint64_t out[BATCH];
+	unsigned char key[16];
+	unsigned i, j;
+
+	for (j = 0; j < 16; j++) {
+		key[j] = xorshift();
+	}
+
+	printf("key len  lanes  per key   (%u keys, batch=%u)\n", keys, BATCH);
+
+	unsigned l, w;
+	for (l = 0; l < sizeof(lens) / sizeof(lens[0]); l++) {
+		uint64_t t0 = monotonic_now();
+		for (i = 0; i < keys; i += BATCH) {
+			for (j = 0; j < BATCH; j++) {
+				sink += siphash24(data[(i + j) % KEYS],
+						  lens[l], key);
+			}
+		}
+		uint64_t t1 = monotonic_now();
+		printf("%7i  %-5s  %5.1f ns\n", lens[l], "-",
+		       (double)(t1 - t0) / keys);
+
+		for (w = 0; w < sizeof(widths) / sizeof(widths[0]); w++) {
+			int lanes = siphash24_batch_init(widths[w]);
+			if (lanes != widths[w]) {
+				printf("%7i  %-5i  unsupported\n", lens[l],
+				       widths[w]);
+				continue;
+			}
+			/* The 4 lane path needs a full word per key */
+			if (lanes == 4 && lens[l] < 8) {
+				printf("%7i  %-5i  scalar fallback\n", lens[l],
+				       lanes);
+				continue;
+			}
+
+			unsigned mismatch =
+				batch_mismatches(data, lens[l], key);
+			t0 = monotonic_now();
+			for (i = 0; i < keys; i += BATCH) {
+				for (j = 0; j < BATCH; j++) {
+					src[j] = data[(i + j) % KEYS];
+				}
+				siphash24_batch(src, lens[l], key, out, BATCH);
+				sink += out[0];
+			}
+			t1 = monotonic_now();
+			printf("%7i  %-5i  %5.1f ns%s\n", lens[l], lanes,
+			       (double)(t1 - t0) / keys,
+			       mismatch ? "   MISMATCH" : "");
+		}
+	}
+	siphash24_batch_init(8);
+
+	/* Generic siphash24() against the fixed length versions */
+	printf("\nkey len  generic        fixed          saved\n");
+	for (l = 0; l < sizeof(fixed_lens) / sizeof(fixed_lens[0]); l++) {
+		int len = fixed_lens[l];
+		uint64_t ns[2], ticks[2];
+		unsigned mismatch = 0;
+		int fixed;
+		for (fixed = 0; fixed < 2; fixed++) {
+			uint64_t t0 = monotonic_now(), c0 = cycles_now();
+			for (i = 0; i < keys; i++) {
+				const uint8_t *k = data[i % KEYS];
+				if (!fixed) {
+					sink += siphash24(k, len, key);
+				} else if (len == 4) {
+					sink += siphash24_4(k, key);
+				} else {
+					sink += siphash24_16(k, key);
+				}
+			}
+			ticks[fixed] = cycles_now() - c0;
+			ns[fixed] = monotonic_now() - t0;
+		}
+		for (i = 0; i < KEYS; i++) {
+			uint64_t h = len == 4 ? siphash24_4(data[i], key)
+					      : siphash24_16(data[i], key);
+			mismatch += h != siphash24(data[i], len, key);
+		}
+		printf("%7i  %4.1f ns %4.0f cy  %4.1f ns %4.0f cy  %4.1f ns "
+		       "%4.0f cy%s\n",
+		       len, (double)ns[0] / keys, (double)ticks[0] / keys,
+		       (double)ns[1] / keys, (double)ticks[1] / keys,
+		       ((double)ns[0] - ns[1]) / keys,
+		       ((double)ticks[0] - ticks[1]) / keys,
+		       mismatch ? "   MISMATCH" : "");
+	}
+	free(data);
+}
+
+/* Address sets shaped like real sources: dense blocks of IPv4 hosts,
+ * one router per IPv4 /24, hosts of one IPv6 /64 with sequential
+ * interface ids, and one router per /64 of an IPv6 /32. Structured
+ * keys are where a weak hash shows. */
+static uint8_t (*address_set(int set, int *key_len))[16]
+{
+	uint8_t(*keys)[16] = calloc(KEYS, 16);
+	unsigned i;
+	for (i = 0; i < KEYS; i++) {
+		uint8_t *k = keys[i];
+		switch (set) {
+		case 0:
+			*key_len = 4;
+			k[0] = 10, k[1] = i >> 16, k[2] = i >> 8, k[3] = i;
+			break;
+		case 1:
+			*key_len = 4;
+			k[0] = 100 + (i >> 16), k[1] = i >> 8, k[2] = i;
+			k[3] = 1;
+			break;
+		case 2:
+			*key_len = 16;
+			k[0] = 0x20, k[1] = 0x01, k[2] = 0x0d, k[3] = 0xb8;
+			k[7] = 1;
+			k[13] = i >> 16, k[14] = i >> 8, k[15] = i;
+			break;
+		case 3:
+			*key_len = 16;
+			k[0] = 0x20, k[1] = 0x01, k[2] = 0x0d, k[3] = 0xb8;
+			k[5] = i >> 16, k[6] = i >> 8, k[7] = i;
+			k[15] = 1;
+			break;
+		}
+	}
+	return keys;
+}
+
+/* Speed and quality of the hashes hlhash.c offers. Distribution is
+ * chi-square per degree of freedom over a source table of the default
+ * size, about 1.0 for a random function, and the fullest bucket.
+ * Collisions are keys landing on a bucket already taken in a table
+ * of a million buckets, against what a random function gives. */
+static void bench_hashes(unsigned keys)
+{
+	static const char *sets[] = {"ipv4 /16", "ipv4 /24s", "ipv6 /64",
+				     "ipv6 /64s"};
+	static const char *names[] = {[HL_HASH_SIPHASH24] = "siphash24",
+				      [HL_HASH_SIPHASH13] = "siphash13",
+				      [HL_HASH_HALFSIPHASH] = "halfsiphash",
+				      [HL_HASH_MULTSHIFT] = "multshift"};
+	const unsigned small = 8191, large = 1048573;
+	unsigned *load = calloc(large, sizeof(unsigned));
+	unsigned char key[16];
+	uint64_t mult[HL_MULT_KEYS];
+	unsigned i, set, h;
+
+	for (i = 0; i < 16; i++) {
+		key[i] = xorshift();
+	}
+	multshift_keys(key, mult);
+
+	double expected =
+		(KEYS - large * (1.0 - pow(1.0 - 1.0 / large, KEYS))) / KEYS;
+	printf("set        hash         per key  chi2/df  max  collisions  "
+	       "(%u keys, random %.2f%%)\n",
+	       KEYS, 100.0 * expected);
+
+	for (set = 0; set < sizeof(sets) / sizeof(sets[0]); set++) {
+		int key_len;
+		uint8_t(*data)[16] = address_set(set, &key_len);
+		for (h = 0; h < sizeof(names) / sizeof(names[0]); h++) {
+			uint64_t t0 = monotonic_now();
+			for (i = 0; i < keys; i++) {
+				sink += hashlimit_hash(h, data[i % KEYS],
+						       key_len, key, mult);
+			}
+			uint64_t t1 = monotonic_now();
+
+			memset(load, 0, large * sizeof(unsigned));
+			unsigned collisions = 0, max = 0;
+			for (i = 0; i < KEYS; i++) {
+				uint64_t x = hashlimit_hash(h, data[i], key_len,
+							    key, mult);
+				collisions += load[x % large]++ != 0;
+			}
+
+			memset(load, 0, small * sizeof(unsigned));
+			for (i = 0; i < KEYS; i++) {
+				uint64_t x = hashlimit_hash(h, data[i], key_len,
+							    key, mult);
+				load[x % small] += 1;
+			}
+			double e = (double)KEYS / small, chi2 = 0.0;
+			for (i = 0; i < small; i++) {
+				chi2 += (load[i] - e) * (load[i] - e) / e;
+				max = load[i] > max ? load[i] : max;
+			}
+
+			printf("%-10s %-12s %5.1f ns  %7.2f  %3u  %9.2f%%\n",
+			       sets[set], names[h], (double)(t1 - t0) / keys,
+			       chi2 / (small - 1), max,
+			       100.0 * collisions / KEYS);
+		}
+		free(data);
+	}
+	free(load);
+}
+
+int main(int argc, char *argv[])
+{
+	const char *all[] = {"clock",    "layout",  "batch",  "contention",
+			     "fidelity", "siphash", "hashes", NULL};
+	const char **benchmarks = argc > 1 ? (const char **)&argv[1] : all;
+
+	for (; *benchmarks; benchmarks++) {
+		if (strcmp(*benchmarks, "clock") == 0) {
+			bench_clock(4000000);
+		} else if (strcmp(*benchmarks, "layout") == 0) {
+			bench_layout(8000000);
+		} else if (strcmp(*benchmarks, "batch") == 0) {
+			bench_batch(8000000);
+		} else if (strcmp(*benchmarks, "contention") == 0) {
+			bench_contention(2000000);
+		} else if (strcmp(*benchmarks, "fidelity") == 0) {
+			bench_fidelity(2000000);
+		} else if (strcmp(*benchmarks, "siphash") == 0) {
+			bench_siphash(16000000);
+		} else if (strcmp(*benchmarks, "hashes") == 0) {
+			bench_hashes(16000000);
+		} else {
+			fprintf(stderr, "Unknown benchmark %s\n", *benchmarks);
+			return 1;
+		}
+		printf("\n");
+	}
+	return 0;
+}